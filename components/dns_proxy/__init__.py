@@ -1,15 +1,190 @@
+import logging
+
 import esphome.codegen as cg
 import esphome.config_validation as cv
-from esphome.const import CONF_ID
+from esphome import automation
+from esphome.components import web_server_base
+from esphome.components.esp32 import add_idf_sdkconfig_option
+from esphome.components.web_server_base import CONF_WEB_SERVER_BASE_ID
+from esphome.const import CONF_ID, CONF_NAME, CONF_PATH, CONF_TIMEOUT
 
 CONF_RECORDS = "records"
 CONF_DOMAIN = "domain"
 CONF_IP = "ip"
+CONF_MAX_PENDING_QUERIES = "max_pending_queries"
+CONF_MAX_UPSTREAM_QUERIES = "max_upstream_queries"
+CONF_UPSTREAM_TIMEOUT = "upstream_timeout"
+CONF_UPSTREAM_RETRIES = "upstream_retries"
+CONF_CACHE_SIZE = "cache_size"
+CONF_HOT_CACHE_SIZE = "hot_cache_size"
+CONF_RECURSIVE = "recursive"
+CONF_PREFETCH_SIBLINGS = "prefetch_siblings"
+CONF_QUERY_LOG_SIZE = "query_log_size"
+CONF_ADAPTIVE_POWER_SAVE = "adaptive_power_save"
+CONF_ACTIVE_QUERIES = "active_queries"
+CONF_QUIET_PERIOD = "quiet_period"
+CONF_METRICS = "metrics"
+CONF_CAPTURE = "capture"
+CONF_BUFFER_SIZE = "buffer_size"
+CONF_MDNS_BRIDGE = "mdns_bridge"
+CONF_LOCAL_RESOLVER = "local_resolver"
+CONF_DNS_PROXY_ID = "dns_proxy_id"
+CONF_ITERATIONS = "iterations"
+CONF_SUFFIX = "suffix"
+CONF_TOP = "top"
+CONF_MAX_MEMORY = "max_memory"
+CONF_MIN_FREE_HEAP = "min_free_heap"
+CONF_MAINTENANCE_BUDGET = "maintenance_budget"
+
+_LOGGER = logging.getLogger(__name__)
+
+# Sizes of the C++ structures on the 32-bit targets; keep in sync with the
+# headers. Used only for the footprint estimate printed at compile time.
+PENDING_QUERY_BYTES = 600  # PendingQuery and its fair queue links
+RECURSION_CONTEXT_BYTES = 548  # RecursionContext
+CACHE_ENTRY_BYTES = 560  # CacheEntry
+RECENT_QUERY_BYTES = 88  # QueryLog::Slot
+LOCAL_RECORD_BYTES = 12  # LocalRecord
+LOCAL_ANSWER_BYTES = 28  # LocalAnswerTable::Slot
+RULE_STATS_BYTES = 8  # RuleStats
+NAME_CELL_SIZE = 32
+NAME_HEADER_BYTES = 12
+INFRA_ZONES = 64
+INFRA_BYTES = INFRA_ZONES * 32 + 128 * 12  # Zones + server RTT table
+RECORD_CALL_FLASH_BYTES = 24  # Code for one add_record() call
 
 DEPENDENCIES = ["wifi", "network"]
+AUTO_LOAD = ["sensor", "text_sensor"]
 
 dns_proxy_ns = cg.esphome_ns.namespace("dns_proxy")
 DnsRedirect = dns_proxy_ns.class_("DnsRedirect", cg.Component)
+DnsMetricsHandler = dns_proxy_ns.class_("DnsMetricsHandler", cg.Component)
+DnsCaptureHandler = dns_proxy_ns.class_("DnsCaptureHandler", cg.Component)
+RunBenchmarkAction = dns_proxy_ns.class_("RunBenchmarkAction", automation.Action)
+FlushCacheAction = dns_proxy_ns.class_("FlushCacheAction", automation.Action)
+DumpRuleStatsAction = dns_proxy_ns.class_("DumpRuleStatsAction", automation.Action)
+StartCaptureAction = dns_proxy_ns.class_("StartCaptureAction", automation.Action)
+StopCaptureAction = dns_proxy_ns.class_("StopCaptureAction", automation.Action)
+
+
+def _next_pow2(value):
+    size = 1
+    while size < value:
+        size <<= 1
+    return size
+
+
+def _byte_size(value):
+    """Accepts a plain number of bytes or a string like "96kB" / "1MB"."""
+    if isinstance(value, int):
+        return cv.positive_int(value)
+    value = cv.string_strict(value).strip()
+    for suffix, factor in (("kB", 1024), ("KB", 1024), ("MB", 1024 * 1024), ("B", 1)):
+        if value.endswith(suffix):
+            try:
+                return cv.positive_int(int(float(value[: -len(suffix)]) * factor))
+            except ValueError:
+                break
+    return cv.positive_int(value)
+
+
+def _record_key(domain):
+    return domain.lower().rstrip(".")
+
+
+def _check_records(records):
+    """Warns about rules that can never be used or only repeat another rule."""
+    exact = {}
+    wildcards = {}
+    for record in records:
+        key = _record_key(record[CONF_DOMAIN])
+        table = wildcards if key.startswith("*.") else exact
+        name = key[2:] if key.startswith("*.") else key
+        if name in table:
+            _LOGGER.warning("dns_proxy: record '%s' is listed more than once; only one of them is used",
+                            record[CONF_DOMAIN])
+        table[name] = record[CONF_IP]
+
+    def covering_wildcard(name):
+        # Most specific wildcard strictly above name, as the lookup picks it
+        labels = name.split(".")
+        for i in range(1, len(labels)):
+            parent = ".".join(labels[i:])
+            if parent in wildcards:
+                return parent
+        return None
+
+    for name, ip in exact.items():
+        parent = covering_wildcard(name)
+        if parent is not None and wildcards[parent] == ip:
+            _LOGGER.warning("dns_proxy: record '%s' is already answered by '*.%s' with the same address",
+                            name, parent)
+    for name, ip in wildcards.items():
+        parent = covering_wildcard(name)
+        if parent is not None and wildcards[parent] == ip:
+            _LOGGER.warning("dns_proxy: record '*.%s' is already answered by '*.%s' with the same address",
+                            name, parent)
+
+
+def _footprint(config):
+    """Estimated RAM (internal, PSRAM-capable) and flash use per structure."""
+    records = config[CONF_RECORDS]
+    names = [_record_key(r[CONF_DOMAIN]) for r in records]
+    exact = sum(1 for n in names if not n.startswith("*."))
+    pending = config[CONF_MAX_PENDING_QUERIES]
+    cache = config[CONF_CACHE_SIZE]
+    hot = min(config[CONF_HOT_CACHE_SIZE], cache)
+    recursive = config[CONF_RECURSIVE]
+
+    cells = 32 + len(records) * 2 + cache * 3 + (INFRA_ZONES * 2 if recursive else 0)
+    cells = min(cells, 0xFFFE)
+    record_cells = sum(-(-(NAME_HEADER_BYTES + len(n.removeprefix("*.")) + 2) // NAME_CELL_SIZE) for n in names)
+
+    rows = [
+        (f"records ({exact} exact, {len(records) - exact} wildcard)",
+         len(records) * (LOCAL_RECORD_BYTES + RULE_STATS_BYTES), 0),
+        ("fast-path answer table", _next_pow2(exact * 2) * LOCAL_ANSWER_BYTES if exact else 0, 0),
+        (f"name arena ({cells} cells, {record_cells} used by records)",
+         0, cells * NAME_CELL_SIZE + (cells + 31) // 32 * 4 + _next_pow2(cells // 2) * 2),
+        (f"pending pool ({pending} queries)", pending * PENDING_QUERY_BYTES, 0),
+        (f"cache ({cache} responses)", 0,
+         cache * CACHE_ENTRY_BYTES + _next_pow2(cache) * 2 * 4 if cache else 0),
+        (f"hot cache tier ({hot} responses, with PSRAM only)", hot * (CACHE_ENTRY_BYTES + 2), 0),
+        (f"query log ({config[CONF_QUERY_LOG_SIZE]} entries)", config[CONF_QUERY_LOG_SIZE] * RECENT_QUERY_BYTES, 0),
+    ]
+    if recursive:
+        rows.append(("recursion state", 0, pending * RECURSION_CONTEXT_BYTES + INFRA_BYTES))
+    if CONF_CAPTURE in config:
+        rows.append(("packet capture buffer", 0, config[CONF_CAPTURE][CONF_BUFFER_SIZE]))
+    flash = sum(len(r[CONF_DOMAIN]) + len(r[CONF_IP]) + 2 + RECORD_CALL_FLASH_BYTES for r in records)
+    return rows, flash
+
+
+def _validate_footprint(config):
+    _check_records(config[CONF_RECORDS])
+    if CONF_MAX_MEMORY in config:
+        rows, _ = _footprint(config)
+        total = sum(internal + large for _, internal, large in rows)
+        if total > config[CONF_MAX_MEMORY]:
+            raise cv.Invalid(
+                f"Estimated memory use of {total} bytes exceeds {CONF_MAX_MEMORY} ({config[CONF_MAX_MEMORY]} bytes); "
+                f"reduce {CONF_CACHE_SIZE}, {CONF_MAX_PENDING_QUERIES} or the number of records"
+            )
+    return config
+
+
+def _log_footprint(config):
+    rows, flash = _footprint(config)
+    _LOGGER.info("dns_proxy: estimated memory footprint (PSRAM* = PSRAM if the board has it, internal RAM otherwise):")
+    for label, internal, large in rows:
+        if internal or large:
+            where = "PSRAM*" if large else "RAM"
+            _LOGGER.info("  %-48s %8.1f kB %s", label, (internal + large) / 1024, where)
+    internal = sum(row[1] for row in rows)
+    large = sum(row[2] for row in rows)
+    _LOGGER.info("  %-48s %8.1f kB RAM + %.1f kB PSRAM*", "total", internal / 1024, large / 1024)
+    _LOGGER.info("  %-48s %8.1f kB", "flash (record strings and setup code)", flash / 1024)
+
 
 CONFIG_SCHEMA = cv.Schema({
     cv.GenerateID(): cv.declare_id(DnsRedirect),
@@ -17,12 +192,163 @@ CONFIG_SCHEMA = cv.Schema({
         cv.Required(CONF_DOMAIN): cv.string,
         cv.Required(CONF_IP): cv.string,
     })),
+    cv.Optional(CONF_MAX_PENDING_QUERIES, default=16): cv.int_range(min=1, max=256),
+    cv.Optional(CONF_MAX_UPSTREAM_QUERIES, default=8): cv.int_range(min=1, max=256),
+    cv.Optional(CONF_UPSTREAM_TIMEOUT, default="2s"): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_UPSTREAM_RETRIES, default=1): cv.int_range(min=0, max=5),
+    cv.Optional(CONF_CACHE_SIZE, default=64): cv.int_range(min=0, max=4096),
+    cv.Optional(CONF_HOT_CACHE_SIZE, default=8): cv.int_range(min=0, max=32),
+    cv.Optional(CONF_RECURSIVE, default=False): cv.boolean,
+    cv.Optional(CONF_PREFETCH_SIBLINGS, default=False): cv.boolean,
+    cv.Optional(CONF_QUERY_LOG_SIZE, default=16): cv.int_range(min=0, max=64),
+    cv.Optional(CONF_MAINTENANCE_BUDGET, default="2ms"): cv.All(
+        cv.positive_time_period_microseconds,
+        cv.Range(min=cv.TimePeriod(microseconds=100), max=cv.TimePeriod(milliseconds=20)),
+    ),
+    cv.Optional(CONF_ADAPTIVE_POWER_SAVE): cv.Schema({
+        cv.Optional(CONF_ACTIVE_QUERIES, default=1): cv.int_range(min=1, max=1000),
+        cv.Optional(CONF_QUIET_PERIOD, default="30s"): cv.positive_time_period_milliseconds,
+    }),
+    cv.Optional(CONF_MDNS_BRIDGE): cv.All(
+        cv.Schema({
+            cv.Optional(CONF_TIMEOUT, default="1s"): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(max=cv.TimePeriod(seconds=5)),
+            ),
+        }),
+        cv.requires_component("mdns"),
+    ),
+    cv.Optional(CONF_LOCAL_RESOLVER): cv.All(cv.boolean, cv.only_with_esp_idf),
+    cv.Optional(CONF_METRICS): cv.Schema({
+        cv.GenerateID(): cv.declare_id(DnsMetricsHandler),
+        cv.GenerateID(CONF_WEB_SERVER_BASE_ID): cv.use_id(web_server_base.WebServerBase),
+        cv.Optional(CONF_PATH, default="/metrics"): cv.string,
+    }),
+    cv.Optional(CONF_CAPTURE): cv.Schema({
+        cv.GenerateID(): cv.declare_id(DnsCaptureHandler),
+        cv.GenerateID(CONF_WEB_SERVER_BASE_ID): cv.use_id(web_server_base.WebServerBase),
+        cv.Optional(CONF_BUFFER_SIZE, default="256kB"): cv.All(_byte_size, cv.int_range(min=4096)),
+        cv.Optional(CONF_PATH, default="/capture.pcap"): cv.string,
+    }),
+    cv.Optional(CONF_MAX_MEMORY): _byte_size,
+    cv.Optional(CONF_MIN_FREE_HEAP, default="24kB"): _byte_size,
 }).extend(cv.COMPONENT_SCHEMA)
 
+CONFIG_SCHEMA = cv.All(CONFIG_SCHEMA, _validate_footprint)
+
 
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
+    _log_footprint(config)
+
+    cg.add(var.set_max_pending(config[CONF_MAX_PENDING_QUERIES]))
+    cg.add(var.set_max_upstream(config[CONF_MAX_UPSTREAM_QUERIES]))
+    cg.add(var.set_upstream_timeout(config[CONF_UPSTREAM_TIMEOUT]))
+    cg.add(var.set_upstream_retries(config[CONF_UPSTREAM_RETRIES]))
+    cg.add(var.set_cache_size(config[CONF_CACHE_SIZE]))
+    cg.add(var.set_hot_cache_size(config[CONF_HOT_CACHE_SIZE]))
+    cg.add(var.set_recursive(config[CONF_RECURSIVE]))
+    cg.add(var.set_prefetch_siblings(config[CONF_PREFETCH_SIBLINGS]))
+    cg.add(var.set_query_log_size(config[CONF_QUERY_LOG_SIZE]))
+    cg.add(var.set_maintenance_budget(config[CONF_MAINTENANCE_BUDGET]))
+    cg.add(var.set_min_free_heap(config[CONF_MIN_FREE_HEAP]))
+    if CONF_ADAPTIVE_POWER_SAVE in config:
+        power_save = config[CONF_ADAPTIVE_POWER_SAVE]
+        cg.add(var.set_adaptive_power_save(power_save[CONF_ACTIVE_QUERIES], power_save[CONF_QUIET_PERIOD]))
+
+    if CONF_MDNS_BRIDGE in config:
+        cg.add(var.set_mdns_bridge(config[CONF_MDNS_BRIDGE][CONF_TIMEOUT]))
+        cg.add_define("USE_DNS_PROXY_MDNS")
+
+    if config.get(CONF_LOCAL_RESOLVER):
+        # Route the device's own netconn/getaddrinfo() lookups through the proxy
+        add_idf_sdkconfig_option("CONFIG_LWIP_HOOK_NETCONN_EXT_RESOLVE_CUSTOM", True)
+        cg.add_define("USE_DNS_PROXY_LOCAL_RESOLVER")
+
+    if CONF_METRICS in config:
+        metrics = config[CONF_METRICS]
+        base = await cg.get_variable(metrics[CONF_WEB_SERVER_BASE_ID])
+        handler = cg.new_Pvariable(metrics[CONF_ID], var, base, metrics[CONF_PATH])
+        await cg.register_component(handler, metrics)
+        cg.add_define("USE_DNS_PROXY_METRICS")
+
+    if CONF_CAPTURE in config:
+        capture = config[CONF_CAPTURE]
+        cg.add(var.set_capture_buffer(capture[CONF_BUFFER_SIZE]))
+        base = await cg.get_variable(capture[CONF_WEB_SERVER_BASE_ID])
+        handler = cg.new_Pvariable(capture[CONF_ID], var, base, capture[CONF_PATH])
+        await cg.register_component(handler, capture)
+        cg.add_define("USE_DNS_PROXY_CAPTURE")
 
     for record in config[CONF_RECORDS]:
         cg.add(var.add_record(record[CONF_DOMAIN], record[CONF_IP]))
+
+
+@automation.register_action(
+    "dns_proxy.run_benchmark",
+    RunBenchmarkAction,
+    cv.Schema({
+        cv.GenerateID(): cv.use_id(DnsRedirect),
+        cv.Optional(CONF_ITERATIONS, default=1000): cv.templatable(cv.int_range(min=1, max=20000)),
+    }),
+)
+async def run_benchmark_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    iterations = await cg.templatable(config[CONF_ITERATIONS], args, cg.uint32)
+    cg.add(var.set_iterations(iterations))
+    return var
+
+
+@automation.register_action(
+    "dns_proxy.flush_cache",
+    FlushCacheAction,
+    cv.All(
+        cv.Schema({
+            cv.GenerateID(): cv.use_id(DnsRedirect),
+            cv.Optional(CONF_NAME): cv.templatable(cv.string),
+            cv.Optional(CONF_SUFFIX): cv.templatable(cv.string),
+        }),
+        cv.has_at_most_one_key(CONF_NAME, CONF_SUFFIX),
+    ),
+)
+async def flush_cache_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    if CONF_NAME in config:
+        name = await cg.templatable(config[CONF_NAME], args, cg.std_string)
+        cg.add(var.set_name(name))
+    if CONF_SUFFIX in config:
+        suffix = await cg.templatable(config[CONF_SUFFIX], args, cg.std_string)
+        cg.add(var.set_suffix(suffix))
+    return var
+
+
+@automation.register_action(
+    "dns_proxy.dump_rule_stats",
+    DumpRuleStatsAction,
+    cv.Schema({
+        cv.GenerateID(): cv.use_id(DnsRedirect),
+        cv.Optional(CONF_TOP, default=10): cv.templatable(cv.int_range(min=1, max=50)),
+    }),
+)
+async def dump_rule_stats_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    top = await cg.templatable(config[CONF_TOP], args, cg.uint8)
+    cg.add(var.set_top(top))
+    return var
+
+
+CAPTURE_ACTION_SCHEMA = automation.maybe_simple_id({
+    cv.GenerateID(): cv.use_id(DnsRedirect),
+})
+
+
+@automation.register_action("dns_proxy.start_capture", StartCaptureAction, CAPTURE_ACTION_SCHEMA)
+@automation.register_action("dns_proxy.stop_capture", StopCaptureAction, CAPTURE_ACTION_SCHEMA)
+async def capture_action_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    return var
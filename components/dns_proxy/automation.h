@@ -0,0 +1,62 @@
+#pragma once
+
+#include "esphome/core/automation.h"
+#include "dns_proxy.h"
+
+namespace esphome {
+namespace dns_proxy {
+
+template<typename... Ts> class RunBenchmarkAction : public Action<Ts...>, public Parented<DnsRedirect> {
+ public:
+  TEMPLATABLE_VALUE(uint32_t, iterations)
+
+  void play(Ts... x) override { this->parent_->run_benchmark(this->iterations_.value(x...)); }
+};
+
+template<typename... Ts> class FlushCacheAction : public Action<Ts...>, public Parented<DnsRedirect> {
+ public:
+  TEMPLATABLE_VALUE(std::string, name)
+  TEMPLATABLE_VALUE(std::string, suffix)
+
+  void play(Ts... x) override {
+    if (this->suffix_.has_value()) {
+      this->parent_->flush_cache_suffix(this->suffix_.value(x...));
+    } else if (this->name_.has_value()) {
+      this->parent_->flush_cache_name(this->name_.value(x...));
+    } else {
+      this->parent_->flush_cache();
+    }
+  }
+};
+
+template<typename... Ts> class DumpRuleStatsAction : public Action<Ts...>, public Parented<DnsRedirect> {
+ public:
+  TEMPLATABLE_VALUE(uint8_t, top)
+
+  void play(Ts... x) override { this->parent_->dump_rule_stats(this->top_.value(x...)); }
+};
+
+// Without capture: configured there is no buffer to record into; the
+// actions then only say so.
+template<typename... Ts> class StartCaptureAction : public Action<Ts...>, public Parented<DnsRedirect> {
+ public:
+  void play(Ts... x) override {
+#ifdef USE_DNS_PROXY_CAPTURE
+    this->parent_->start_capture();
+#else
+    ESP_LOGW("dns_proxy", "start_capture needs capture: in the dns_proxy config");
+#endif
+  }
+};
+
+template<typename... Ts> class StopCaptureAction : public Action<Ts...>, public Parented<DnsRedirect> {
+ public:
+  void play(Ts... x) override {
+#ifdef USE_DNS_PROXY_CAPTURE
+    this->parent_->stop_capture();
+#endif
+  }
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+#ifdef USE_DNS_PROXY_CAPTURE
+
+#include "esphome/core/component.h"
+#include "esphome/components/web_server_base/web_server_base.h"
+#include "dns_proxy.h"
+#include "packet_capture.h"
+
+namespace esphome {
+namespace dns_proxy {
+
+static const char *const CAPTURE_CONTENT_TYPE = "application/vnd.tcpdump.pcap";
+
+// Serves the capture buffer as a pcap file on the web_server. Packets are
+// converted one at a time into a small buffer and sent as chunks; capturing
+// may continue meanwhile, the download ends at the packets present when it
+// started. A new capture can't start until the download is done.
+class DnsCaptureHandler : public AsyncWebHandler, public Component {
+ public:
+  DnsCaptureHandler(DnsRedirect *parent, web_server_base::WebServerBase *base, const char *path)
+      : parent_(parent), base_(base), path_(path) {}
+
+  bool canHandle(AsyncWebServerRequest *request) override {
+    return request->method() == HTTP_GET && request->url() == this->path_;
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override {
+    const PacketCapture &capture = this->parent_->get_capture();
+#ifdef USE_ESP_IDF
+    httpd_req_t *req = *request;
+    httpd_resp_set_type(req, CAPTURE_CONTENT_TYPE);
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"dns_proxy.pcap\"");
+    this->write_pcap(capture, [req](const uint8_t *data, size_t len) {
+      httpd_resp_send_chunk(req, reinterpret_cast<const char *>(data), len);
+    });
+    httpd_resp_send_chunk(req, nullptr, 0);
+#else
+    AsyncResponseStream *stream = request->beginResponseStream(CAPTURE_CONTENT_TYPE);
+    stream->addHeader("Content-Disposition", "attachment; filename=\"dns_proxy.pcap\"");
+    this->write_pcap(capture, [stream](const uint8_t *data, size_t len) { stream->write(data, len); });
+    request->send(stream);
+#endif
+  }
+
+  void setup() override {
+    this->base_->init();
+    this->base_->add_handler(this);
+  }
+
+  float get_setup_priority() const override { return setup_priority::WIFI - 1.0f; }
+
+ protected:
+  template<typename F> void write_pcap(const PacketCapture &capture, F send) {
+    send(this->buf_, pcap_file_header(this->buf_));
+    if (!capture.enabled()) return;
+
+    uint32_t end;
+    if (!capture.begin_read(&end)) return;  // A capture is just starting
+    CaptureRecord record;
+    const uint8_t *payload;
+    for (uint32_t at = 0; (at = capture.next(at, end, &record, &payload)) != 0;) {
+      send(this->buf_, pcap_packet(record, payload, this->buf_));
+    }
+    capture.end_read();
+  }
+
+  DnsRedirect *parent_;
+  web_server_base::WebServerBase *base_;
+  const char *path_;
+  uint8_t buf_[44 + CAPTURE_SNAPLEN];
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
+
+#endif  // USE_DNS_PROXY_CAPTURE
@@ -0,0 +1,775 @@
+#pragma once
+
+#include "dns_message.h"
+#include "name_arena.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+namespace dns_proxy {
+
+// Responses larger than this are passed through but not cached.
+static const size_t CACHE_MAX_RESPONSE = 512;
+// Upper bound on how long anything is kept, regardless of upstream TTLs.
+static const uint32_t CACHE_MAX_TTL = 86400;
+static const uint16_t CACHE_NONE = 0xFFFF;
+// Entries are indexed under their last 1..N labels for suffix invalidation.
+static const uint8_t CACHE_SUFFIX_DEPTH = 3;
+// Hits an entry needs before it is copied into the hot tier.
+static const uint8_t CACHE_PROMOTE_HITS = 2;
+static const uint8_t CACHE_HOT_NONE = 0xFF;
+
+inline uint32_t dns_hash_name(const uint8_t *name, uint16_t qtype) {
+  return dns_hash_type(dns_hash_wire(name), qtype);
+}
+
+// The last `labels` labels of an uncompressed wire name.
+inline const uint8_t *dns_name_suffix(const uint8_t *name, uint8_t labels) {
+  for (uint8_t skip = dns_label_count(name); skip > labels; skip--) name += name[0] + 1;
+  return name;
+}
+
+struct CacheEntry {
+  uint32_t hash;
+  NameHandle name;  // Interned QNAME
+  uint32_t stored_ms;
+  uint32_t expires_ms;
+  uint16_t next;  // Bucket chain
+  uint16_t len;   // 0 = slot unused
+  uint16_t qtype;
+  uint8_t referenced;  // CLOCK bit
+  uint8_t suffix_depth;
+  uint8_t hits;  // Towards promotion, while not hot
+  uint8_t hot;   // Hot tier slot holding a copy, or CACHE_HOT_NONE
+  uint32_t suffix_hash[CACHE_SUFFIX_DEPTH];  // Suffix index chains, one per depth
+  uint16_t suffix_prev[CACHE_SUFFIX_DEPTH];
+  uint16_t suffix_next[CACHE_SUFFIX_DEPTH];
+  uint8_t data[CACHE_MAX_RESPONSE];
+};
+
+// Shards the cache is split into when it has room for at least
+// CACHE_SHARD_MIN entries per shard.
+static const uint8_t CACHE_SHARDS = 4;
+static const uint16_t CACHE_SHARD_MIN = 16;
+// Attempts of a lock-free read before giving up on a shard being written.
+static const uint8_t CACHE_READ_RETRIES = 4;
+
+// Adds to a counter only the tcpip thread changes and other threads read: a
+// relaxed load and store, no read-modify-write needed.
+template<typename T> inline void dns_counter_add(std::atomic<T> &counter, int delta) {
+  counter.store(static_cast<T>(counter.load(std::memory_order_relaxed) + delta), std::memory_order_relaxed);
+}
+
+// One slice of the cache: its own entries, hash buckets, CLOCK hand and
+// counters. The sequence counter is odd while the tcpip thread changes the
+// shard, so other threads can read it without a lock (see read()).
+struct CacheShard {
+  std::atomic<uint32_t> seq{0};
+  std::atomic<uint32_t> hits{0};
+  std::atomic<uint32_t> misses{0};
+  std::atomic<uint32_t> evictions{0};
+  uint16_t first;  // Entry slots [first, first + capacity)
+  uint16_t capacity;
+  std::atomic<uint16_t> size{0};
+  uint16_t hand{0};
+  uint16_t *buckets;
+  uint16_t bucket_count;
+};
+
+// Fixed-capacity cache of complete upstream responses keyed by (QNAME, QTYPE).
+// All storage is allocated once in init(); lookups and inserts never allocate.
+// Names live in the shared arena, so chains compare handles, not strings.
+// Changed only from the tcpip thread; read() may be called from any thread.
+//
+// On boards with PSRAM the entries live there, and a small hot tier in
+// internal RAM keeps copies of the entries hit repeatedly. lookup() checks
+// the hot tier first and answers from it without touching PSRAM beyond the
+// original's CLOCK bit. The hot tier evicts with its own CLOCK hand, which
+// demotes the entry back to PSRAM only; entries leaving the cache take their
+// hot copy with them.
+class DnsCache {
+ public:
+  bool init(uint16_t capacity, NameArena *names, uint8_t hot_capacity = 0) {
+    if (capacity == 0 || names == nullptr || !names->enabled()) return false;
+    names_ = names;
+    shard_count_ = capacity >= CACHE_SHARDS * CACHE_SHARD_MIN ? CACHE_SHARDS : 1;
+    bucket_count_ = 1;
+    while (bucket_count_ * shard_count_ < capacity) bucket_count_ <<= 1;
+    suffix_bucket_count_ = bucket_count_ * shard_count_;
+    entries_ = static_cast<CacheEntry *>(dns_alloc_large(sizeof(CacheEntry) * capacity));
+    buckets_ = static_cast<uint16_t *>(dns_alloc_large(sizeof(uint16_t) * bucket_count_ * shard_count_));
+    suffix_buckets_ =
+        static_cast<uint16_t *>(dns_alloc_large(sizeof(uint16_t) * suffix_bucket_count_ * CACHE_SUFFIX_DEPTH));
+    if (entries_ == nullptr || buckets_ == nullptr || suffix_buckets_ == nullptr) {
+      dns_free_large(entries_);
+      dns_free_large(buckets_);
+      dns_free_large(suffix_buckets_);
+      entries_ = nullptr;
+      buckets_ = nullptr;
+      suffix_buckets_ = nullptr;
+      return false;
+    }
+    capacity_ = capacity;
+    for (uint8_t i = 0; i < shard_count_; i++) {
+      CacheShard &shard = shards_[i];
+      shard.first = (uint32_t) capacity * i / shard_count_;
+      shard.capacity = (uint32_t) capacity * (i + 1) / shard_count_ - shard.first;
+      shard.buckets = buckets_ + i * bucket_count_;
+      shard.bucket_count = bucket_count_;
+    }
+    clear_buckets();
+
+    // Pointless without PSRAM: the entries are in internal RAM already
+    hot_target_ = dns_has_psram() ? (hot_capacity < capacity ? hot_capacity : capacity) : 0;
+    restore_hot();
+    return true;
+  }
+
+  // Frees the hot tier to give internal RAM back; the entries stay cached.
+  void release_hot() {
+    if (hot_ == nullptr) return;
+    for (uint8_t i = 0; i < hot_capacity_; i++) {
+      if (hot_[i].len != 0) entries_[hot_slot_[i]].hot = CACHE_HOT_NONE;
+    }
+    dns_free_large(hot_);
+    dns_free_large(hot_slot_);
+    hot_ = nullptr;
+    hot_slot_ = nullptr;
+    hot_capacity_ = 0;
+    hot_count_.store(0, std::memory_order_relaxed);
+    hot_hand_ = 0;
+  }
+
+  // Allocates the hot tier (again); it stays off if internal RAM is short.
+  void restore_hot() {
+    if (hot_ != nullptr || hot_target_ == 0) return;
+    hot_ = static_cast<CacheEntry *>(dns_alloc_internal(sizeof(CacheEntry) * hot_target_));
+    hot_slot_ = static_cast<uint16_t *>(dns_alloc_internal(sizeof(uint16_t) * hot_target_));
+    if (hot_ != nullptr && hot_slot_ != nullptr) {
+      hot_capacity_ = hot_target_;
+      return;
+    }
+    dns_free_large(hot_);
+    dns_free_large(hot_slot_);
+    hot_ = nullptr;
+    hot_slot_ = nullptr;
+  }
+
+  // Internal RAM the hot tier takes when allocated.
+  uint32_t hot_bytes() const { return hot_target_ * (sizeof(CacheEntry) + sizeof(uint16_t)); }
+
+  bool enabled() const { return entries_ != nullptr; }
+  uint16_t capacity() const { return capacity_; }
+  uint16_t size() const {
+    uint16_t total = 0;
+    for (uint8_t i = 0; i < shard_count_; i++) total += shards_[i].size.load(std::memory_order_relaxed);
+    return total;
+  }
+  uint32_t get_hits() const {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < shard_count_; i++) total += shards_[i].hits.load(std::memory_order_relaxed);
+    return total;
+  }
+  uint32_t get_misses() const {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < shard_count_; i++) total += shards_[i].misses.load(std::memory_order_relaxed);
+    return total;
+  }
+  uint32_t get_evictions() const {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < shard_count_; i++) total += shards_[i].evictions.load(std::memory_order_relaxed);
+    return total;
+  }
+  uint32_t get_expired() const { return expired_; }
+  const ProbeStats &get_probe_stats() const { return probe_stats_; }
+
+  // Lookup counters, saved and put back around the self-benchmark.
+  struct Counters {
+    uint32_t hits[CACHE_SHARDS];
+    uint32_t misses[CACHE_SHARDS];
+    uint32_t hot_hits;
+    ProbeStats probes;
+  };
+  Counters save_counters() const {
+    Counters saved{};
+    for (uint8_t i = 0; i < shard_count_; i++) {
+      saved.hits[i] = shards_[i].hits.load(std::memory_order_relaxed);
+      saved.misses[i] = shards_[i].misses.load(std::memory_order_relaxed);
+    }
+    saved.hot_hits = hot_hits_;
+    saved.probes = probe_stats_;
+    return saved;
+  }
+  void restore_counters(const Counters &saved) {
+    for (uint8_t i = 0; i < shard_count_; i++) {
+      shards_[i].hits.store(saved.hits[i], std::memory_order_relaxed);
+      shards_[i].misses.store(saved.misses[i], std::memory_order_relaxed);
+    }
+    hot_hits_ = saved.hot_hits;
+    probe_stats_ = saved.probes;
+  }
+  uint8_t get_shard_count() const { return shard_count_; }
+  uint8_t hot_capacity() const { return hot_capacity_; }
+  uint8_t hot_size() const { return hot_count_.load(std::memory_order_relaxed); }
+  uint32_t get_hot_hits() const { return hot_hits_; }
+  uint32_t get_promotions() const { return promotions_; }
+  uint32_t get_demotions() const { return demotions_; }
+  const CacheShard &get_shard(uint8_t shard) const { return shards_[shard]; }
+
+  // Finds a live entry for the uncompressed wire name and type.
+  const CacheEntry *lookup(const uint8_t *name, uint16_t qtype, uint32_t now) {
+    if (!enabled()) return nullptr;
+    uint32_t name_hash = dns_hash_wire(name);
+    uint32_t hash = dns_hash_type(name_hash, qtype);
+    CacheShard &shard = shard_for(hash);
+
+    uint8_t hot = find_hot(name, qtype, hash);
+    if (hot != CACHE_HOT_NONE) {
+      CacheEntry &copy = hot_[hot];
+      if ((int32_t) (now - copy.expires_ms) >= 0) {
+        remove(hot_slot_[hot]);
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      }
+      copy.referenced = 1;
+      entries_[hot_slot_[hot]].referenced = 1;  // Keeps the original from being evicted under it
+      hot_hits_++;
+      shard.hits.fetch_add(1, std::memory_order_relaxed);
+      return &copy;
+    }
+
+    NameHandle handle = names_->find(name, name_hash);
+    uint16_t idx = handle != NAME_NONE ? find(handle, qtype, hash) : CACHE_NONE;
+    if (idx == CACHE_NONE) {
+      shard.misses.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    CacheEntry &entry = entries_[idx];
+    if ((int32_t) (now - entry.expires_ms) >= 0) {
+      remove(idx);
+      shard.misses.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    entry.referenced = 1;
+    shard.hits.fetch_add(1, std::memory_order_relaxed);
+    if (hot_capacity_ > 0 && ++entry.hits >= CACHE_PROMOTE_HITS) promote(idx);
+    return &entry;
+  }
+
+  // True if a live entry exists, without counting a hit or miss.
+  bool contains(const uint8_t *name, uint16_t qtype, uint32_t now) const {
+    if (!enabled()) return false;
+    uint32_t name_hash = dns_hash_wire(name);
+    NameHandle handle = names_->find(name, name_hash);
+    uint16_t idx = handle != NAME_NONE ? find(handle, qtype, dns_hash_type(name_hash, qtype)) : CACHE_NONE;
+    return idx != CACHE_NONE && (int32_t) (now - entries_[idx].expires_ms) < 0;
+  }
+
+  // Lock-free lookup for threads other than the tcpip thread: copies a live
+  // response for name/qtype into out (CACHE_MAX_RESPONSE bytes) and returns
+  // its length. Returns 0 on a miss, and also when the shard kept changing or
+  // the hash was shared with another name; the caller then asks the tcpip
+  // thread.
+  uint16_t read(const uint8_t *name, uint16_t qtype, uint32_t now, uint8_t *out) {
+    uint16_t len = 0;
+    bool found = read_entry(name, qtype, now, [&](const uint8_t *data, uint16_t data_len) {
+      memcpy(out, data, data_len);
+      len = data_len;
+    });
+    return found ? len : 0;
+  }
+
+  // Like read(), but takes only the first A record's address out of a NOERROR
+  // answer, so callers need no response-sized buffer on their stack.
+  uint32_t read_address(const uint8_t *name, uint32_t now) {
+    uint32_t ip = 0;
+    bool found = read_entry(name, DNS_TYPE_A, now, [&](const uint8_t *data, uint16_t data_len) {
+      ip = (data[3] & 0x0F) == DNS_RCODE_NOERROR ? dns_first_address(data, data_len) : 0;
+    });
+    return found ? ip : 0;
+  }
+
+  // Stores a response (must carry exactly one question). Responses that are
+  // truncated, too large, or neither NOERROR nor NXDOMAIN are ignored.
+  void insert(const uint8_t *msg, size_t len, uint32_t now) {
+    if (!enabled() || len > CACHE_MAX_RESPONSE || len < DNS_HEADER_SIZE) return;
+    if (msg[2] & DNS_FLAG_TC) return;
+    uint8_t rcode = msg[3] & 0x0F;
+    if (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN) return;
+    if (dns_read_u16(msg + 4) != 1) return;
+
+    size_t name_end;
+    uint16_t qtype;
+    if (!dns_parse_question(msg, len, &name_end, &qtype)) return;
+    if (dns_read_u16(msg + name_end + 2) != DNS_CLASS_IN) return;
+
+    uint32_t ttl = dns_min_ttl(msg, len);
+    if (ttl == UINT32_MAX) ttl = rcode == DNS_RCODE_NXDOMAIN ? 60 : 0;  // Negative answer without SOA
+    if (ttl == 0) return;
+    if (ttl > CACHE_MAX_TTL) ttl = CACHE_MAX_TTL;
+
+    const uint8_t *name = msg + DNS_HEADER_SIZE;
+    uint32_t name_hash = dns_hash_wire(name);
+    NameHandle handle = names_->intern(name, name_hash);
+    if (handle == NAME_NONE) return;  // Arena full
+    uint32_t hash = dns_hash_type(name_hash, qtype);
+    CacheShard &shard = shard_for(hash);
+    write_begin(shard);
+    uint16_t idx = find(handle, qtype, hash);
+    if (idx != CACHE_NONE) unlink(idx);
+    idx = allocate(shard);
+
+    CacheEntry &entry = entries_[idx];
+    entry.hash = hash;
+    entry.name = handle;
+    entry.qtype = qtype;
+    entry.stored_ms = now;
+    entry.expires_ms = now + ttl * 1000;
+    entry.referenced = 0;
+    entry.hits = 0;
+    entry.hot = CACHE_HOT_NONE;
+    entry.len = len;
+    memcpy(entry.data, msg, len);
+
+    uint16_t &bucket = shard.buckets[hash & (shard.bucket_count - 1)];
+    entry.next = bucket;
+    bucket = idx;
+    link_suffixes(idx);
+    dns_counter_add(shard.size, 1);
+    write_end(shard);
+  }
+
+  // Removes the entry in slot idx if it has expired, so stale answers don't
+  // hold on to their names until they are evicted. Called for one slot at a
+  // time by the incremental maintenance.
+  void reap(uint16_t idx, uint32_t now) {
+    if (!enabled() || idx >= capacity_) return;
+    CacheEntry &entry = entries_[idx];
+    if (entry.len == 0 || (int32_t) (now - entry.expires_ms) < 0) return;
+    remove(idx);
+    expired_++;
+  }
+
+  // Drops every entry. Returns how many were removed.
+  uint16_t flush() {
+    if (!enabled()) return 0;
+    uint16_t removed = size();
+    for (uint8_t i = 0; i < shard_count_; i++) write_begin(shards_[i]);
+    for (uint16_t i = 0; i < capacity_; i++) {
+      if (entries_[i].len != 0) names_->release(entries_[i].name);
+      entries_[i].len = 0;
+    }
+    clear_buckets();
+    for (uint8_t i = 0; i < hot_capacity_; i++) hot_[i].len = 0;
+    hot_count_.store(0, std::memory_order_relaxed);
+    for (uint8_t i = 0; i < shard_count_; i++) {
+      shards_[i].size.store(0, std::memory_order_relaxed);
+      write_end(shards_[i]);
+    }
+    return removed;
+  }
+
+  // Drops all types cached for name, or with subtree also everything below
+  // it. Only walks the suffix index chain for the name, never the whole cache.
+  uint16_t flush_matching(const uint8_t *name, bool subtree) {
+    if (!enabled()) return 0;
+    uint8_t labels = dns_label_count(name);
+    if (labels == 0) return subtree ? flush() : 0;
+    uint8_t depth = labels < CACHE_SUFFIX_DEPTH ? labels : CACHE_SUFFIX_DEPTH;
+    uint32_t hash = dns_hash_name(dns_name_suffix(name, depth), 0);
+    uint16_t removed = 0;
+    uint16_t idx = suffix_bucket(depth - 1, hash);
+    while (idx != CACHE_NONE) {
+      CacheEntry &entry = entries_[idx];
+      uint16_t next = entry.suffix_next[depth - 1];
+      const uint8_t *entry_name = entry.data + DNS_HEADER_SIZE;
+      if (entry.suffix_hash[depth - 1] == hash &&
+          (subtree ? dns_name_in_zone(entry_name, name) : dns_name_equal(entry_name, name))) {
+        remove(idx);
+        removed++;
+      }
+      idx = next;
+    }
+    return removed;
+  }
+
+  // Builds the reply for a client in out (at least entry.len bytes): the
+  // client's ID, RD bit and question spelling, with TTLs aged.
+  size_t build_reply(const CacheEntry &entry, const uint8_t *request, uint8_t *out, uint32_t now) const {
+    memcpy(out, entry.data, entry.len);
+    out[0] = request[0];
+    out[1] = request[1];
+    out[2] = (out[2] & ~DNS_FLAG_RD) | (request[2] & DNS_FLAG_RD);
+    size_t name_len = dns_name_length(out + DNS_HEADER_SIZE);
+    memcpy(out + DNS_HEADER_SIZE, request + DNS_HEADER_SIZE, name_len);
+    dns_age_ttls(out, entry.len, (now - entry.stored_ms) / 1000);
+    return entry.len;
+  }
+
+ protected:
+  // Shards are picked by high hash bits, buckets within a shard by low ones.
+  CacheShard &shard_for(uint32_t hash) { return shards_[(hash >> 24) % shard_count_]; }
+  const CacheShard &shard_for(uint32_t hash) const { return shards_[(hash >> 24) % shard_count_]; }
+
+  // Single writer (the tcpip thread), so plain stores suffice; the fences
+  // order them against the entry writes for readers on other cores.
+  static void write_begin(CacheShard &shard) {
+    shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  static void write_end(CacheShard &shard) {
+    shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Walks the shard optimistically and hands a live entry's response to take,
+  // whose result only counts if the shard's sequence counter didn't move
+  // meanwhile. The entry may be torn while take reads it, so take must stay
+  // within the length it is given. The name is compared in place: that stops
+  // at the end of name, however the entry was torn.
+  template<typename F> bool read_entry(const uint8_t *name, uint16_t qtype, uint32_t now, F take) {
+    if (!enabled()) return false;
+    uint32_t hash = dns_hash_name(name, qtype);
+    CacheShard &shard = shard_for(hash);
+    for (uint8_t attempt = 0; attempt < CACHE_READ_RETRIES; attempt++) {
+      uint32_t seq = shard.seq.load(std::memory_order_acquire);
+      if (seq & 1) continue;
+
+      bool found = false;
+      bool live = false;
+      bool same = false;
+      uint16_t idx = shard.buckets[hash & (shard.bucket_count - 1)];
+      for (uint16_t steps = 0; idx < capacity_ && steps < shard.capacity; steps++) {
+        const CacheEntry &entry = entries_[idx];
+        if (entry.hash == hash && entry.qtype == qtype && entry.len != 0) {
+          found = true;
+          live = (int32_t) (now - entry.expires_ms) < 0;
+          same = dns_name_equal(entry.data + DNS_HEADER_SIZE, name);
+          if (live && same) take(entry.data, entry.len <= CACHE_MAX_RESPONSE ? entry.len : CACHE_MAX_RESPONSE);
+          break;
+        }
+        idx = entry.next;
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (shard.seq.load(std::memory_order_relaxed) != seq) continue;
+      if (!found || !live) {
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      if (!same) return false;
+      shard.hits.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+  uint16_t find(NameHandle name, uint16_t qtype, uint32_t hash) const {
+    const CacheShard &shard = shard_for(hash);
+    uint16_t probes = 0;
+    for (uint16_t idx = shard.buckets[hash & (shard.bucket_count - 1)]; idx != CACHE_NONE;
+         idx = entries_[idx].next) {
+      const CacheEntry &entry = entries_[idx];
+      probes++;
+      if (entry.name == name && entry.qtype == qtype) {
+        probe_stats_.record(probes);
+        return idx;
+      }
+    }
+    probe_stats_.record(probes);
+    return CACHE_NONE;
+  }
+
+  void remove(uint16_t idx) {
+    CacheShard &shard = shard_for(entries_[idx].hash);
+    write_begin(shard);
+    unlink(idx);
+    write_end(shard);
+  }
+
+  // Takes an entry out of its shard; the caller holds the shard's write side.
+  void unlink(uint16_t idx) {
+    CacheEntry &entry = entries_[idx];
+    CacheShard &shard = shard_for(entry.hash);
+    uint16_t *link = &shard.buckets[entry.hash & (shard.bucket_count - 1)];
+    while (*link != idx) link = &entries_[*link].next;
+    *link = entry.next;
+    unlink_suffixes(idx);
+    names_->release(entry.name);
+    if (entry.hot != CACHE_HOT_NONE) {
+      hot_[entry.hot].len = 0;
+      dns_counter_add(hot_count_, -1);
+    }
+    entry.len = 0;
+    dns_counter_add(shard.size, -1);
+  }
+
+  // Hot tier slot with a copy of name/qtype, or CACHE_HOT_NONE. The tier is
+  // small, so a scan over internal RAM beats any index in PSRAM.
+  uint8_t find_hot(const uint8_t *name, uint16_t qtype, uint32_t hash) const {
+    for (uint8_t i = 0; i < hot_capacity_; i++) {
+      const CacheEntry &copy = hot_[i];
+      if (copy.len != 0 && copy.hash == hash && copy.qtype == qtype &&
+          dns_name_equal(copy.data + DNS_HEADER_SIZE, name)) {
+        return i;
+      }
+    }
+    return CACHE_HOT_NONE;
+  }
+
+  // Copies entry idx into the hot tier, demoting whichever copy the hot
+  // CLOCK hand settles on.
+  void promote(uint16_t idx) {
+    uint8_t slot;
+    while (true) {
+      slot = hot_hand_;
+      hot_hand_ = (hot_hand_ + 1) % hot_capacity_;
+      if (hot_[slot].len == 0) {
+        dns_counter_add(hot_count_, 1);
+        break;
+      }
+      if (hot_[slot].referenced) {
+        hot_[slot].referenced = 0;
+        continue;
+      }
+      CacheEntry &demoted = entries_[hot_slot_[slot]];
+      demoted.hot = CACHE_HOT_NONE;
+      demoted.hits = 0;  // Has to earn its way back
+      demotions_++;
+      break;
+    }
+
+    CacheEntry &entry = entries_[idx];
+    memcpy(&hot_[slot], &entry, offsetof(CacheEntry, data) + entry.len);
+    hot_[slot].referenced = 0;
+    hot_slot_[slot] = idx;
+    entry.hot = slot;
+    promotions_++;
+  }
+
+  uint16_t &suffix_bucket(uint8_t depth, uint32_t hash) {
+    return suffix_buckets_[depth * suffix_bucket_count_ + (hash & (suffix_bucket_count_ - 1))];
+  }
+
+  // Doubly linked so that evictions unlink in constant time even from the
+  // long chains of popular TLDs. The suffix index spans all shards and is
+  // only ever used on the tcpip thread.
+  void link_suffixes(uint16_t idx) {
+    CacheEntry &entry = entries_[idx];
+    const uint8_t *name = entry.data + DNS_HEADER_SIZE;
+    uint8_t labels = dns_label_count(name);
+    entry.suffix_depth = labels < CACHE_SUFFIX_DEPTH ? labels : CACHE_SUFFIX_DEPTH;
+    for (uint8_t d = 0; d < entry.suffix_depth; d++) {
+      entry.suffix_hash[d] = dns_hash_name(dns_name_suffix(name, d + 1), 0);
+      uint16_t &head = suffix_bucket(d, entry.suffix_hash[d]);
+      entry.suffix_prev[d] = CACHE_NONE;
+      entry.suffix_next[d] = head;
+      if (head != CACHE_NONE) entries_[head].suffix_prev[d] = idx;
+      head = idx;
+    }
+  }
+
+  void unlink_suffixes(uint16_t idx) {
+    CacheEntry &entry = entries_[idx];
+    for (uint8_t d = 0; d < entry.suffix_depth; d++) {
+      uint16_t prev = entry.suffix_prev[d];
+      uint16_t next = entry.suffix_next[d];
+      if (prev != CACHE_NONE) {
+        entries_[prev].suffix_next[d] = next;
+      } else {
+        suffix_bucket(d, entry.suffix_hash[d]) = next;
+      }
+      if (next != CACHE_NONE) entries_[next].suffix_prev[d] = prev;
+    }
+  }
+
+  void clear_buckets() {
+    for (uint32_t i = 0; i < (uint32_t) bucket_count_ * shard_count_; i++) buckets_[i] = CACHE_NONE;
+    for (uint32_t i = 0; i < (uint32_t) suffix_bucket_count_ * CACHE_SUFFIX_DEPTH; i++) suffix_buckets_[i] = CACHE_NONE;
+  }
+
+  // Returns a free slot of the shard, evicting with the CLOCK algorithm when
+  // it is full.
+  uint16_t allocate(CacheShard &shard) {
+    if (shard.size.load(std::memory_order_relaxed) < shard.capacity) {
+      for (uint16_t i = shard.first; i < shard.first + shard.capacity; i++) {
+        if (entries_[i].len == 0) return i;
+      }
+    }
+    while (true) {
+      uint16_t idx = shard.first + shard.hand;
+      CacheEntry &entry = entries_[idx];
+      shard.hand = (shard.hand + 1) % shard.capacity;
+      if (entry.len == 0) return idx;
+      if (entry.referenced) {
+        entry.referenced = 0;
+        continue;
+      }
+      unlink(idx);
+      dns_counter_add(shard.evictions, 1);
+      return idx;
+    }
+  }
+
+  NameArena *names_{nullptr};
+  CacheEntry *entries_{nullptr};
+  uint16_t *buckets_{nullptr};  // bucket_count_ per shard, shard after shard
+  uint16_t *suffix_buckets_{nullptr};
+  uint16_t capacity_{0};
+  uint16_t bucket_count_{0};  // Per shard
+  uint16_t suffix_bucket_count_{0};
+  CacheShard shards_[CACHE_SHARDS];
+  uint8_t shard_count_{1};
+  uint32_t expired_{0};
+  mutable ProbeStats probe_stats_;
+
+  CacheEntry *hot_{nullptr};       // Internal RAM copies
+  uint16_t *hot_slot_{nullptr};    // Entry each copy was taken from
+  uint8_t hot_capacity_{0};
+  uint8_t hot_target_{0};  // Configured, while released too
+  std::atomic<uint8_t> hot_count_{0};  // Copies in use; lets other threads read the size without touching hot_
+  uint8_t hot_hand_{0};
+  uint32_t hot_hits_{0};
+  uint32_t promotions_{0};
+  uint32_t demotions_{0};
+};
+
+static const uint8_t INFRA_MAX_SERVERS = 4;
+static const uint16_t INFRA_ZONES = 64;
+static const uint16_t INFRA_SERVER_STATS = 128;
+static const uint16_t INFRA_INITIAL_RTT = 200;
+static const uint16_t INFRA_MAX_RTT = 5000;
+
+struct InfraZone {
+  NameHandle name;  // NAME_NONE = slot unused
+  uint32_t expires_ms;
+  uint32_t last_used_ms;
+  uint32_t servers[INFRA_MAX_SERVERS];  // IPv4, network byte order as lwIP stores it
+  uint8_t server_count;
+};
+
+struct InfraServer {
+  uint32_t ip;
+  uint16_t srtt_ms;  // Smoothed RTT
+  uint32_t last_used_ms;
+};
+
+// Delegation knowledge for the iterative resolver: which servers are
+// authoritative for a zone (NS + glue) and how fast each server answers.
+// Lives in one block, in PSRAM when available.
+class InfraCache {
+ public:
+  bool init(NameArena *names) {
+    names_ = names;
+    zones_ = static_cast<InfraZone *>(dns_alloc_large(sizeof(InfraZone) * INFRA_ZONES));
+    servers_ = static_cast<InfraServer *>(dns_alloc_large(sizeof(InfraServer) * INFRA_SERVER_STATS));
+    return zones_ != nullptr && servers_ != nullptr && names_->enabled();
+  }
+
+  bool enabled() const { return zones_ != nullptr && servers_ != nullptr; }
+  uint32_t get_zone_count() const {
+    uint32_t count = 0;
+    for (uint16_t i = 0; zones_ != nullptr && i < INFRA_ZONES; i++) count += zones_[i].name != NAME_NONE;
+    return count;
+  }
+
+  const uint8_t *zone_name(const InfraZone &zone) const { return names_->name(zone.name); }
+
+  // Deepest cached zone enclosing name, or nullptr (meaning: start at the root).
+  const InfraZone *closest_zone(const uint8_t *name, uint32_t now) {
+    for (size_t pos = 0; name[pos] != 0; pos += name[pos] + 1) {
+      NameHandle suffix = names_->find(name + pos);
+      if (suffix == NAME_NONE) continue;
+      for (uint16_t i = 0; i < INFRA_ZONES; i++) {
+        InfraZone &zone = zones_[i];
+        if (zone.name == suffix) {
+          if ((int32_t) (now - zone.expires_ms) >= 0 || zone.server_count == 0) break;
+          zone.last_used_ms = now;
+          return &zone;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  void add_zone(const uint8_t *name, const uint32_t *servers, uint8_t count, uint32_t ttl, uint32_t now) {
+    if (name[0] == 0 || count == 0) return;
+    if (ttl > CACHE_MAX_TTL) ttl = CACHE_MAX_TTL;
+
+    NameHandle handle = names_->intern(name);
+    if (handle == NAME_NONE) return;
+    InfraZone *slot = nullptr;
+    for (uint16_t i = 0; i < INFRA_ZONES; i++) {
+      InfraZone &zone = zones_[i];
+      if (zone.name == handle) {
+        slot = &zone;
+        break;
+      }
+      // Otherwise prefer an empty slot, then the least recently used one
+      if (slot == nullptr || (slot->name != NAME_NONE && (zone.name == NAME_NONE ||
+                                                         (int32_t) (zone.last_used_ms - slot->last_used_ms) < 0))) {
+        slot = &zone;
+      }
+    }
+
+    names_->release(slot->name);  // Drops the zone's old name, or the extra reference to the same one
+    slot->name = handle;
+    slot->expires_ms = now + ttl * 1000;
+    slot->last_used_ms = now;
+    slot->server_count = count < INFRA_MAX_SERVERS ? count : INFRA_MAX_SERVERS;
+    memcpy(slot->servers, servers, slot->server_count * sizeof(uint32_t));
+  }
+
+  // Picks the server with the lowest smoothed RTT, skipping one to avoid.
+  uint32_t best_server(const uint32_t *servers, uint8_t count, uint32_t avoid, uint32_t now) {
+    uint32_t best = 0;
+    uint16_t best_rtt = UINT16_MAX;
+    for (uint8_t i = 0; i < count; i++) {
+      if (servers[i] == avoid && count > 1) continue;
+      uint16_t rtt = stats(servers[i], now).srtt_ms;
+      if (rtt < best_rtt) {
+        best = servers[i];
+        best_rtt = rtt;
+      }
+    }
+    return best;
+  }
+
+  void record_rtt(uint32_t ip, uint32_t rtt_ms, uint32_t now) {
+    InfraServer &server = stats(ip, now);
+    if (rtt_ms > INFRA_MAX_RTT) rtt_ms = INFRA_MAX_RTT;
+    server.srtt_ms = (server.srtt_ms * 7 + rtt_ms) / 8;
+  }
+
+  void record_timeout(uint32_t ip, uint32_t now) {
+    InfraServer &server = stats(ip, now);
+    server.srtt_ms = server.srtt_ms * 2 < INFRA_MAX_RTT ? server.srtt_ms * 2 : INFRA_MAX_RTT;
+  }
+
+ protected:
+  InfraServer &stats(uint32_t ip, uint32_t now) {
+    InfraServer *victim = &servers_[0];
+    for (uint16_t i = 0; i < INFRA_SERVER_STATS; i++) {
+      InfraServer &server = servers_[i];
+      if (server.ip == ip) {
+        server.last_used_ms = now;
+        return server;
+      }
+      if (server.ip == 0 || (victim->ip != 0 && (int32_t) (server.last_used_ms - victim->last_used_ms) < 0)) {
+        victim = &server;
+      }
+    }
+    victim->ip = ip;
+    victim->srtt_ms = INFRA_INITIAL_RTT;
+    victim->last_used_ms = now;
+    return *victim;
+  }
+
+  NameArena *names_{nullptr};
+  InfraZone *zones_{nullptr};
+  InfraServer *servers_{nullptr};
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
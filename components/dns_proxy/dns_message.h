@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+namespace dns_proxy {
+
+static const size_t DNS_HEADER_SIZE = 12;
+static const size_t DNS_MAX_NAME = 255;
+
+static const uint16_t DNS_TYPE_A = 1;
+static const uint16_t DNS_TYPE_NS = 2;
+static const uint16_t DNS_TYPE_CNAME = 5;
+static const uint16_t DNS_TYPE_SOA = 6;
+static const uint16_t DNS_TYPE_PTR = 12;
+static const uint16_t DNS_TYPE_MX = 15;
+static const uint16_t DNS_TYPE_AAAA = 28;
+static const uint16_t DNS_TYPE_OPT = 41;
+static const uint16_t DNS_TYPE_HTTPS = 65;
+static const uint16_t DNS_CLASS_IN = 1;
+
+static const uint8_t DNS_RCODE_NOERROR = 0;
+static const uint8_t DNS_RCODE_FORMERR = 1;
+static const uint8_t DNS_RCODE_SERVFAIL = 2;
+static const uint8_t DNS_RCODE_NXDOMAIN = 3;
+
+static const uint8_t DNS_FLAG_QR = 0x80;
+static const uint8_t DNS_FLAG_AA = 0x04;
+static const uint8_t DNS_FLAG_TC = 0x02;
+static const uint8_t DNS_FLAG_RD = 0x01;
+static const uint8_t DNS_FLAG_RA = 0x80;
+
+// Small helpers for walking DNS messages in wire format. All of them are
+// bounds-checked against the message length and return 0 on malformed input
+// (offset 0 is never a valid position after the header).
+
+inline uint16_t dns_read_u16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+inline uint32_t dns_read_u32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+inline void dns_write_u16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+inline void dns_write_u32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+inline uint8_t dns_lower(uint8_t c) { return (c >= 'A' && c <= 'Z') ? c + 32 : c; }
+
+// Returns the position just past the (possibly compressed) name at pos.
+inline size_t dns_skip_name(const uint8_t *msg, size_t len, size_t pos) {
+  while (pos < len) {
+    uint8_t label = msg[pos];
+    if (label == 0) return pos + 1;
+    if ((label & 0xC0) == 0xC0) return pos + 2 <= len ? pos + 2 : 0;
+    if (label > 63) return 0;
+    pos += label + 1;
+  }
+  return 0;
+}
+
+// Expands the name at pos into uncompressed, lower-cased wire format. Returns
+// the position just past the name in msg.
+inline size_t dns_read_name(const uint8_t *msg, size_t len, size_t pos, uint8_t *out, size_t *out_len) {
+  size_t next = 0;
+  size_t n = 0;
+  int jumps = 0;
+  while (pos < len) {
+    uint8_t label = msg[pos];
+    if ((label & 0xC0) == 0xC0) {
+      if (pos + 1 >= len || ++jumps > 16) return 0;
+      if (next == 0) next = pos + 2;
+      pos = ((label & 0x3F) << 8) | msg[pos + 1];
+      continue;
+    }
+    if (label > 63 || pos + 1 + label > len || n + 1 + label > DNS_MAX_NAME) return 0;
+    out[n++] = label;
+    if (label == 0) {
+      *out_len = n;
+      return next != 0 ? next : pos + 1;
+    }
+    for (uint8_t i = 0; i < label; i++) out[n++] = dns_lower(msg[pos + 1 + i]);
+    pos += label + 1;
+  }
+  return 0;
+}
+
+// Length of an uncompressed wire name including the root label.
+inline size_t dns_name_length(const uint8_t *name) {
+  size_t n = 0;
+  while (name[n] != 0) n += name[n] + 1;
+  return n + 1;
+}
+
+inline bool dns_name_equal(const uint8_t *a, const uint8_t *b) {
+  size_t n = 0;
+  while (true) {
+    if (a[n] != b[n]) return false;
+    if (a[n] == 0) return true;
+    uint8_t label = a[n++];
+    for (uint8_t i = 0; i < label; i++, n++) {
+      if (dns_lower(a[n]) != dns_lower(b[n])) return false;
+    }
+  }
+}
+
+// True if name equals zone or lies below it. Both uncompressed wire format.
+inline bool dns_name_in_zone(const uint8_t *name, const uint8_t *zone) {
+  size_t name_len = dns_name_length(name);
+  size_t zone_len = dns_name_length(zone);
+  size_t pos = 0;
+  while (name_len - pos > zone_len) pos += name[pos] + 1;
+  return name_len - pos == zone_len && dns_name_equal(name + pos, zone);
+}
+
+// Dotted text form of an uncompressed wire name, truncated to fit cap.
+inline void dns_name_to_text(const uint8_t *name, char *out, size_t cap) {
+  size_t n = 0;
+  for (size_t pos = 0; name[pos] != 0; pos += name[pos] + 1) {
+    if (n > 0 && n < cap - 1) out[n++] = '.';
+    for (uint8_t i = 1; i <= name[pos] && n < cap - 1; i++) out[n++] = name[pos + i];
+  }
+  out[n] = '\0';
+}
+
+inline uint8_t dns_label_count(const uint8_t *name) {
+  uint8_t count = 0;
+  for (size_t n = 0; name[n] != 0; n += name[n] + 1) count++;
+  return count;
+}
+
+// Encodes a dotted name ("www.example.com", trailing dot optional) into
+// lower-cased wire format. Returns the length including the root label, or 0
+// if a label is empty or too long.
+inline size_t dns_encode_name(const char *text, size_t len, uint8_t *out) {
+  if (len > 0 && text[len - 1] == '.') len--;
+  size_t n = 0;
+  size_t start = 0;
+  while (start < len) {
+    size_t dot = start;
+    while (dot < len && text[dot] != '.') dot++;
+    size_t label = dot - start;
+    if (label == 0 || label > 63 || n + 1 + label + 1 > DNS_MAX_NAME) return 0;
+    out[n++] = label;
+    for (size_t i = 0; i < label; i++) out[n++] = dns_lower(text[start + i]);
+    start = dot + 1;
+  }
+  out[n++] = 0;
+  return n;
+}
+
+// Locates the first question. Sets *name_end to the offset just past QNAME.
+// The QNAME must be uncompressed (nothing precedes it to point at) and end
+// inside the message, as callers go on to walk msg + DNS_HEADER_SIZE as a
+// plain wire name.
+inline bool dns_parse_question(const uint8_t *msg, size_t len, size_t *name_end, uint16_t *qtype) {
+  if (len < DNS_HEADER_SIZE || dns_read_u16(msg + 4) == 0) return false;
+  size_t pos = DNS_HEADER_SIZE;
+  while (pos < len && msg[pos] != 0) {
+    if (msg[pos] > 63) return false;  // Compression pointer or reserved label type
+    pos += msg[pos] + 1;
+  }
+  pos++;
+  if (pos + 4 > len || pos - DNS_HEADER_SIZE > DNS_MAX_NAME) return false;
+  *name_end = pos;
+  *qtype = dns_read_u16(msg + pos);
+  return true;
+}
+
+// Position just past the question section, or 0.
+inline size_t dns_skip_questions(const uint8_t *msg, size_t len) {
+  if (len < DNS_HEADER_SIZE) return 0;
+  size_t pos = DNS_HEADER_SIZE;
+  for (uint16_t i = dns_read_u16(msg + 4); i > 0; i--) {
+    pos = dns_skip_name(msg, len, pos);
+    if (pos == 0 || pos + 4 > len) return 0;
+    pos += 4;
+  }
+  return pos;
+}
+
+// Position just past the resource record at pos, or 0.
+inline size_t dns_skip_rr(const uint8_t *msg, size_t len, size_t pos) {
+  pos = dns_skip_name(msg, len, pos);
+  if (pos == 0 || pos + 10 > len) return 0;
+  size_t end = pos + 10 + dns_read_u16(msg + pos + 8);
+  return end <= len ? end : 0;
+}
+
+// First A record's address in a message, or 0.
+inline uint32_t dns_first_address(const uint8_t *msg, size_t len) {
+  size_t pos = dns_skip_questions(msg, len);
+  for (uint16_t i = dns_read_u16(msg + 6); i > 0 && pos != 0; i--) {
+    size_t fields = dns_skip_name(msg, len, pos);
+    if (fields == 0 || fields + 14 > len) return 0;
+    if (dns_read_u16(msg + fields) == DNS_TYPE_A && dns_read_u16(msg + fields + 8) == 4) {
+      uint32_t ip;
+      memcpy(&ip, msg + fields + 10, 4);
+      return ip;
+    }
+    pos = dns_skip_rr(msg, len, pos);
+  }
+  return 0;
+}
+
+// True if the response carries the same question (name, type, class) as the
+// query we sent. Guards the cache against mismatched or spoofed answers.
+inline bool dns_question_matches(const uint8_t *query, size_t query_len, const uint8_t *resp, size_t resp_len) {
+  size_t q_end, r_end;
+  uint16_t q_type, r_type;
+  if (!dns_parse_question(query, query_len, &q_end, &q_type) ||
+      !dns_parse_question(resp, resp_len, &r_end, &r_type)) {
+    return false;
+  }
+  if (q_type != r_type || dns_read_u16(query + q_end + 2) != dns_read_u16(resp + r_end + 2)) return false;
+  if (q_end != r_end) return false;
+  return dns_name_equal(query + DNS_HEADER_SIZE, resp + DNS_HEADER_SIZE);
+}
+
+// Copies the record at pos into out with all names expanded, so it can be
+// placed into a different message. Returns the position past the record.
+inline size_t dns_copy_rr(const uint8_t *msg, size_t len, size_t pos, uint8_t *out, size_t cap, size_t *out_len) {
+  uint8_t name[DNS_MAX_NAME + 1];
+  size_t name_len;
+  pos = dns_read_name(msg, len, pos, name, &name_len);
+  if (pos == 0 || pos + 10 > len) return 0;
+
+  uint16_t type = dns_read_u16(msg + pos);
+  uint16_t rdlen = dns_read_u16(msg + pos + 8);
+  size_t rdata = pos + 10;
+  size_t end = rdata + rdlen;
+  if (end > len || name_len + 10 > cap) return 0;
+
+  size_t n = 0;
+  memcpy(out, name, name_len);
+  n += name_len;
+  memcpy(out + n, msg + pos, 8);
+  n += 10;  // RDLENGTH is filled in below
+  size_t rd_start = n;
+
+  // Leading fixed fields and embedded names per type (RFC 1035 section 3.3)
+  size_t fixed = 0;
+  int names = 0;
+  size_t trailer = 0;
+  switch (type) {
+    case DNS_TYPE_CNAME:
+    case DNS_TYPE_NS:
+    case DNS_TYPE_PTR:
+      names = 1;
+      break;
+    case DNS_TYPE_MX:
+      fixed = 2;
+      names = 1;
+      break;
+    case DNS_TYPE_SOA:
+      names = 2;
+      trailer = 20;
+      break;
+    default:
+      break;
+  }
+
+  if (names == 0) {
+    if (n + rdlen > cap) return 0;
+    memcpy(out + n, msg + rdata, rdlen);
+    n += rdlen;
+  } else {
+    size_t p = rdata;
+    if (fixed > rdlen || n + fixed > cap) return 0;
+    memcpy(out + n, msg + p, fixed);
+    n += fixed;
+    p += fixed;
+    for (int i = 0; i < names; i++) {
+      p = dns_read_name(msg, len, p, name, &name_len);
+      if (p == 0 || p > end || n + name_len > cap) return 0;
+      memcpy(out + n, name, name_len);
+      n += name_len;
+    }
+    if (p + trailer != end || n + trailer > cap) return 0;
+    memcpy(out + n, msg + p, trailer);
+    n += trailer;
+  }
+
+  dns_write_u16(out + rd_start - 2, n - rd_start);
+  *out_len = n;
+  return end;
+}
+
+// Smallest TTL over all records except OPT, or UINT32_MAX if there are none.
+inline uint32_t dns_min_ttl(const uint8_t *msg, size_t len) {
+  size_t pos = dns_skip_questions(msg, len);
+  if (pos == 0) return 0;
+  uint32_t rrs = dns_read_u16(msg + 6) + dns_read_u16(msg + 8) + dns_read_u16(msg + 10);
+  uint32_t min_ttl = UINT32_MAX;
+  for (uint32_t i = 0; i < rrs; i++) {
+    size_t fields = dns_skip_name(msg, len, pos);
+    size_t next = dns_skip_rr(msg, len, pos);
+    if (fields == 0 || next == 0) return 0;
+    if (dns_read_u16(msg + fields) != DNS_TYPE_OPT) {
+      uint32_t ttl = dns_read_u32(msg + fields + 4);
+      if (ttl < min_ttl) min_ttl = ttl;
+    }
+    pos = next;
+  }
+  return min_ttl;
+}
+
+// Subtracts elapsed seconds from every TTL in the message (except OPT).
+inline void dns_age_ttls(uint8_t *msg, size_t len, uint32_t elapsed) {
+  size_t pos = dns_skip_questions(msg, len);
+  if (pos == 0 || elapsed == 0) return;
+  uint32_t rrs = dns_read_u16(msg + 6) + dns_read_u16(msg + 8) + dns_read_u16(msg + 10);
+  for (uint32_t i = 0; i < rrs; i++) {
+    size_t fields = dns_skip_name(msg, len, pos);
+    size_t next = dns_skip_rr(msg, len, pos);
+    if (fields == 0 || next == 0) return;
+    if (dns_read_u16(msg + fields) != DNS_TYPE_OPT) {
+      uint32_t ttl = dns_read_u32(msg + fields + 4);
+      dns_write_u32(msg + fields + 4, ttl > elapsed ? ttl - elapsed : 0);
+    }
+    pos = next;
+  }
+}
+
+}  // namespace dns_proxy
+}  // namespace esphome
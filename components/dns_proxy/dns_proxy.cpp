@@ -0,0 +1,68 @@
+#include "dns_proxy.h"
+
+#ifdef USE_DNS_PROXY_LOCAL_RESOLVER
+
+#include <lwip/api.h>
+#include <lwip/priv/tcpip_priv.h>
+
+namespace esphome {
+namespace dns_proxy {
+
+DnsRedirect *global_dns_proxy = nullptr;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+namespace {
+
+struct LocalResolveCall {
+  struct tcpip_api_call_data base;  // Must come first
+  DnsRedirect *proxy;
+  uint8_t name[DNS_MAX_NAME + 1];
+  uint32_t ip;
+};
+
+}  // namespace
+
+uint32_t DnsRedirect::resolve_locally(const char *name) {
+  if (udp_pcb_ == nullptr) return 0;
+
+  LocalResolveCall call;
+  call.proxy = this;
+  call.ip = 0;
+  if (dns_encode_name(name, strlen(name), call.name) <= 1) return 0;
+
+  // Cached answers are read lock-free from this task. Names with a record are
+  // never forwarded, so a cached answer can't be shadowing one.
+  uint32_t ip = cache_.read_address(call.name, dns_millis());
+  if (ip != 0) return ip;
+
+  // Records and cache belong to the tcpip thread; run the lookup there and wait
+  tcpip_api_call(
+      [](struct tcpip_api_call_data *data) -> err_t {
+        auto *call = reinterpret_cast<LocalResolveCall *>(data);
+        call->ip = call->proxy->local_address(call->name);
+        return ERR_OK;
+      },
+      &call.base);
+  return call.ip;
+}
+
+}  // namespace dns_proxy
+}  // namespace esphome
+
+// Called by netconn_gethostbyname() (getaddrinfo(), esp_http_client,
+// esp-mqtt, ...) before lwIP's own resolver. Returning 1 means the name was
+// answered here; 0 lets lwIP query the upstream server as usual.
+extern "C" int lwip_hook_netconn_external_resolve(const char *name, ip_addr_t *addr, u8_t addrtype, err_t *err) {
+  using esphome::dns_proxy::global_dns_proxy;
+  if (global_dns_proxy == nullptr) return 0;
+#if LWIP_IPV4 && LWIP_IPV6
+  if (addrtype == NETCONN_DNS_IPV6) return 0;
+#endif
+
+  uint32_t ip = global_dns_proxy->resolve_locally(name);
+  if (ip == 0) return 0;
+  ip_addr_set_ip4_u32(addr, ip);
+  *err = ERR_OK;
+  return 1;
+}
+
+#endif  // USE_DNS_PROXY_LOCAL_RESOLVER
@@ -1,14 +1,29 @@
 #pragma once
 
 #include "esphome/core/component.h"
+#include "esphome/core/defines.h"
+#include "esphome/core/hal.h"
 #include "esphome/components/sensor/sensor.h"
+#include "esphome/components/text_sensor/text_sensor.h"
+#include "dns_cache.h"
+#include "dns_message.h"
+#include "fair_queue.h"
+#include "heap_guard.h"
+#include "local_answers.h"
+#include "mdns_bridge.h"
+#include "name_arena.h"
+#include "packet_capture.h"
+#include "platform.h"
+#include "query_log.h"
+#include "rate_window.h"
+#include "stat_sensors.h"
 #include <lwip/udp.h>
 #include <lwip/pbuf.h>
 #include <lwip/tcpip.h>
 #include <lwip/dns.h>
 #include <lwip/ip4_addr.h>
-#include <esp_heap_caps.h>
-#include <esp_netif.h>
+#include <lwip/ip.h>
+#include <atomic>
 #include <map>
 #include <vector>
 #include <cstring>
@@ -16,13 +31,124 @@
 namespace esphome {
 namespace dns_proxy {
 
+// Largest query we keep a copy of for retransmission (classic UDP DNS limit).
+static const size_t MAX_QUERY_SIZE = 512;
+
+// How often pending deadlines are checked, and expired cache entries reclaimed.
+static const uint32_t TIMER_INTERVAL_MS = 100;
+static const uint32_t CACHE_REAP_INTERVAL_MS = 10000;
+
+// Benchmark queries handled per tcpip callback; a few milliseconds of work.
+static const uint32_t BENCHMARK_SLICE = 256;
+
+// Query types dual-stack clients send together for one name.
+static const uint16_t SIBLING_TYPES[] = {DNS_TYPE_A, DNS_TYPE_AAAA, DNS_TYPE_HTTPS};
+
+// Where an in-flight resolution currently is. Each state is resumed by either
+// a matching upstream response or its deadline passing in the timer sweep.
+enum class ResolveState : uint8_t {
+  IDLE,            // Slot is free
+  QUEUED,          // Waiting in its client's queue for upstream capacity
+  AWAIT_UPSTREAM,  // Query sent upstream, waiting for a response
+  AWAIT_AUTHORITY,   // Iterative query sent to an authoritative server
+  AWAIT_NS_ADDRESS,  // Waiting for a child resolution of a glueless NS name
+  AWAIT_MDNS,        // Waiting for an mDNS lookup of a .local name
+};
+
+// Queued forwards are told apart by whether their client already had others
+// waiting, which separates occasional lookups from floods in the queue-delay
+// histograms.
+enum class QueueClass : uint8_t {
+  QUIET,
+  BUSY,
+  COUNT,
+};
+
+enum class ResolveEvent : uint8_t {
+  RESPONSE,
+  TIMEOUT,
+};
+
+// One slot of the fixed pending pool. Holds everything needed to resume the
+// resolution later, including a copy of the query for retransmission.
 struct PendingQuery {
+  ResolveState state{ResolveState::IDLE};
+  uint8_t attempts{0};
   ip_addr_t client_addr;
   u16_t client_port;
-  uint16_t transaction_id;
-  uint32_t timestamp;
+  uint16_t transaction_id;  // Client's original ID
+  uint16_t upstream_id;     // ID used on the wire towards upstream
+  uint8_t client_flags;     // Client's header flags (RD bit)
+  bool has_client;          // False for internal lookups (NS addresses)
+  ip_addr_t server;         // Where the query was sent; answers must come from here
+  uint8_t mdns_lookup;      // Bridge slot being waited on (AWAIT_MDNS)
+  QueueClass queue_class;   // Set while QUEUED
+  uint32_t log_serial;      // Entry in the recent-query log
+  uint32_t timestamp;       // First send
+  uint32_t deadline;        // Next timer event
+  uint16_t query_len{0};
+  uint8_t query[MAX_QUERY_SIZE];
 };
 
+// Limits that keep one iterative resolution bounded.
+static const uint8_t RECURSION_MAX_REFERRALS = 16;
+static const uint8_t RECURSION_MAX_CNAMES = 8;
+static const uint8_t RECURSION_MAX_TRIES = 4;
+static const int16_t RECURSION_NO_PARENT = -1;
+
+// Extra state for a pending slot in recursive mode. Indexed like the slot it
+// belongs to and allocated only when recursion is enabled.
+struct RecursionContext {
+  uint16_t qtype;
+  uint8_t referrals;
+  uint8_t cnames;
+  uint8_t zone_labels;  // Depth of the zone currently being asked
+  uint8_t server_count;
+  uint32_t servers[INFRA_MAX_SERVERS];  // Candidates for that zone
+  uint32_t server;                      // The one asked last
+  int16_t parent;                       // Slot waiting on this NS address lookup
+  uint8_t chain_count;
+  uint16_t chain_len;
+  uint8_t chain[CACHE_MAX_RESPONSE];  // CNAME records followed so far, names expanded
+};
+
+// A configured local record; "*.example.com" is kept as example.com with
+// wildcard set.
+struct LocalRecord {
+  NameHandle name;
+  uint32_t ip;
+  bool wildcard;
+};
+
+// Traffic seen by one local record, kept in an array parallel to the records
+// (the index is the rule ID).
+struct RuleStats {
+  uint32_t hits;
+  uint32_t last_hit_ms;
+};
+
+static const uint16_t RULE_NONE = 0xFFFF;
+
+// Rule IDs of the records configured for one name; the name's arena tag is
+// the index of its RuleSlot.
+struct RuleSlot {
+  uint16_t exact;
+  uint16_t wildcard;
+};
+static const uint8_t RULE_REPORT_MAX = 50;
+
+// IPv4 root server addresses (a.root-servers.net to m.root-servers.net).
+static const uint8_t ROOT_HINTS[][4] = {
+    {198, 41, 0, 4},     {170, 247, 170, 2}, {192, 33, 4, 12},  {199, 7, 91, 13},  {192, 203, 230, 10},
+    {192, 5, 5, 241},    {192, 112, 36, 4},  {198, 97, 190, 53}, {192, 36, 148, 17}, {192, 58, 128, 30},
+    {193, 0, 14, 129},   {199, 7, 83, 42},   {202, 12, 27, 33},
+};
+
+class DnsRedirect;
+#ifdef USE_DNS_PROXY_LOCAL_RESOLVER
+extern DnsRedirect *global_dns_proxy;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+#endif
+
 class DnsRedirect : public Component {
  public:
   void add_record(const std::string &domain, const std::string &ip) {
@@ -30,15 +156,135 @@ class DnsRedirect : public Component {
     ESP_LOGI("dns_proxy", "Added DNS record: %s -> %s", domain.c_str(), ip.c_str());
   }
 
+  void set_max_pending(uint16_t max_pending) { max_pending_ = max_pending; }
+  void set_upstream_timeout(uint32_t timeout_ms) { upstream_timeout_ = timeout_ms; }
+  void set_upstream_retries(uint8_t retries) { upstream_retries_ = retries; }
+  void set_cache_size(uint16_t cache_size) { cache_size_ = cache_size; }
+  void set_hot_cache_size(uint8_t hot_cache_size) { hot_cache_size_ = hot_cache_size; }
+  void set_recursive(bool recursive) { recursive_ = recursive; }
+  void set_query_log_size(uint8_t size) { query_log_size_ = size; }
+  void set_prefetch_siblings(bool prefetch) { prefetch_siblings_ = prefetch; }
+  void set_max_upstream(uint16_t max_upstream) { max_upstream_ = max_upstream; }
+  void set_maintenance_budget(uint32_t budget_us) { maintenance_budget_us_ = budget_us; }
+  void set_min_free_heap(uint32_t bytes) { heap_guard_.set_min_free(bytes); }
+#ifdef USE_DNS_PROXY_MDNS
+  void set_mdns_bridge(uint32_t timeout_ms) {
+    mdns_bridge_enabled_ = true;
+    mdns_.set_timeout(timeout_ms);
+  }
+#endif
+#ifdef USE_DNS_PROXY_CAPTURE
+  void set_capture_buffer(uint32_t size) { capture_size_ = size; }
+#endif
+  void set_last_query_text_sensor(text_sensor::TextSensor *sensor) { last_query_text_sensor_ = sensor; }
+  void add_stat_sensor(sensor::Sensor *sensor, Stat stat, uint32_t min_interval_ms, float delta) {
+    stat_sensors_.push_back(StatSensor{sensor, stat, min_interval_ms, delta});
+  }
+  void set_adaptive_power_save(uint32_t active_queries, uint32_t quiet_period_ms) {
+    adaptive_ps_ = true;
+    ps_active_queries_ = active_queries;
+    ps_quiet_period_ = quiet_period_ms;
+  }
+
   uint32_t get_query_count() const { return query_count_; }
+  uint32_t get_fast_path_count() const { return fast_path_count_; }
   uint32_t get_forwarded_count() const { return forwarded_count_; }
-  uint32_t get_record_count() const { return records_.size(); }
-  std::string get_last_query() const { return last_query_; }
+  uint32_t get_prefetch_count() const { return prefetch_count_; }
+  uint32_t get_record_count() const { return local_records_.size(); }
+  uint32_t get_pending_count() const { return pending_active_; }
+  uint32_t get_upstream_inflight() const { return upstream_inflight_; }
+  uint32_t get_upstream_queued() const { return upstream_queued_; }
+  const LatencyHistogram &get_queue_delay(QueueClass queue_class) const {
+    return queue_delay_[static_cast<uint8_t>(queue_class)];
+  }
+  uint32_t get_timeout_count() const { return timeout_count_; }
+  uint32_t get_dropped_count() const { return dropped_count_; }
+  uint32_t get_cache_hits() const { return cache_.get_hits(); }
+  uint32_t get_cache_misses() const { return cache_.get_misses(); }
+  uint32_t get_cache_size() const { return cache_.size(); }
+  uint32_t get_cache_capacity() const { return cache_.capacity(); }
+  uint32_t get_cache_evictions() const { return cache_.get_evictions(); }
+  uint32_t get_cache_expired() const { return cache_.get_expired(); }
+  // Shards are only created for caches of 64 entries or more; smaller ones have one
+  uint8_t get_cache_shard_count() const { return cache_.enabled() ? cache_.get_shard_count() : 0; }
+  const CacheShard &get_cache_shard(uint8_t shard) const { return cache_.get_shard(shard); }
+  // Hot tier in internal RAM; capacity 0 without PSRAM
+  uint32_t get_hot_cache_hits() const { return cache_.get_hot_hits(); }
+  uint32_t get_hot_cache_size() const { return cache_.hot_size(); }
+  uint32_t get_hot_cache_capacity() const { return cache_.hot_capacity(); }
+  uint32_t get_cache_promotions() const { return cache_.get_promotions(); }
+  uint32_t get_cache_demotions() const { return cache_.get_demotions(); }
+  // Maintenance slices that used up their budget and left work for the next one
+  uint32_t get_maintenance_deferred_count() const { return maintenance_deferred_; }
+  const LatencyHistogram &get_upstream_latency() const { return upstream_latency_; }
+  // Upstream latency percentile (p in 0..1) over the last one to two minutes,
+  // NAN without answers. The window only advances while stat sensors exist.
+  float get_upstream_latency_percentile(float p) const { return latency_window_.percentile(upstream_latency_, p); }
+  uint32_t get_infra_zone_count() const { return infra_.enabled() ? infra_.get_zone_count() : 0; }
+  uint32_t get_name_count() const { return names_.get_name_count(); }
+  uint32_t get_name_arena_used() const { return names_.get_used_bytes(); }
+  uint32_t get_name_arena_capacity() const { return names_.get_capacity_bytes(); }
+  // Chain/probe lengths of the hash tables, to spot collision floods
+  const ProbeStats &get_name_probe_stats() const { return names_.get_probe_stats(); }
+  const ProbeStats &get_cache_probe_stats() const { return cache_.get_probe_stats(); }
+  const ProbeStats &get_fast_path_probe_stats() const { return local_answers_.get_probe_stats(); }
+  bool is_recursive() const { return recursive_; }
+  uint32_t get_power_save_transitions() const { return ps_transitions_; }
+  bool is_power_save_suspended() const { return ps_suspended_; }
+
+  // Sliding-window rates (events per second) over the last minute / 15 minutes
+  float get_rate_1m(Metric metric) const { return rates_.rate_1m(metric, dns_millis()); }
+  float get_rate_15m(Metric metric) const { return rates_.rate_15m(metric, dns_millis()); }
+  float get_qps_1m() const { return get_rate_1m(Metric::QUERIES); }
+  float get_qps_15m() const { return get_rate_15m(Metric::QUERIES); }
+  uint32_t get_peak_qps_1m() const { return rates_.peak_1m(dns_millis()); }
+  uint32_t get_peak_qps_15m() const { return rates_.peak_15m(dns_millis()); }
+  // Share of queries answered locally or from the cache, in percent
+  float get_hit_ratio_1m() const {
+    return ratio(rates_.total_1m(Metric::LOCAL_HITS, dns_millis()) + rates_.total_1m(Metric::CACHE_HITS, dns_millis()),
+                 rates_.total_1m(Metric::QUERIES, dns_millis()));
+  }
+  float get_hit_ratio_15m() const {
+    return ratio(rates_.total_15m(Metric::LOCAL_HITS, dns_millis()) + rates_.total_15m(Metric::CACHE_HITS, dns_millis()),
+                 rates_.total_15m(Metric::QUERIES, dns_millis()));
+  }
+  // Share of queries sent upstream, in percent
+  float get_forward_ratio_1m() const {
+    return ratio(rates_.total_1m(Metric::FORWARDS, dns_millis()), rates_.total_1m(Metric::QUERIES, dns_millis()));
+  }
+  float get_forward_ratio_15m() const {
+    return ratio(rates_.total_15m(Metric::FORWARDS, dns_millis()), rates_.total_15m(Metric::QUERIES, dns_millis()));
+  }
+  std::string get_last_query() const {
+    RecentQuery entry;
+    return get_recent_query(0, entry) ? std::string(entry.name) : std::string();
+  }
+  // age 0 is the newest query. False if there is no such entry (any more).
+  bool get_recent_query(uint8_t age, RecentQuery &out) const {
+    uint32_t head = query_log_.head();
+    return age < query_log_.capacity() && head > age && query_log_.read(head - age, out);
+  }
   bool is_running() const { return udp_pcb_ != nullptr; }
   bool has_upstream_dns() const { return has_upstream_dns_; }
-  uint32_t get_free_heap() const { return heap_caps_get_free_size(MALLOC_CAP_DEFAULT); }
+  uint32_t get_free_heap() const { return dns_free_heap(); }
+  uint32_t get_free_internal_heap() const { return dns_free_internal_heap(); }
+  uint32_t get_largest_free_block() const { return dns_largest_free_block(); }
+  HeapPressure get_heap_pressure() const { return heap_pressure_; }
+  // Queries admitted at once: max_pending_queries, less under heap pressure
+  uint32_t get_pending_limit() const { return pending_limit_; }
+  uint32_t get_heap_shed_count() const { return heap_shed_; }
 
   void setup() override {
+    dns_hash_seed();
+    query_log_.init(query_log_size_);
+#ifdef USE_DNS_PROXY_CAPTURE
+    if (!capture_.init(capture_size_)) {
+      ESP_LOGW("dns_proxy", "Could not allocate %u byte capture buffer - capture disabled", (unsigned) capture_size_);
+    }
+#endif
+#ifdef USE_DNS_PROXY_LOCAL_RESOLVER
+    global_dns_proxy = this;
+#endif
 
 #ifdef ARDUINO_ARCH_ESP8266
     // ESP8266 is not supported due to memory and lwIP differences.
@@ -58,49 +304,271 @@ class DnsRedirect : public Component {
   }
 
   void loop() override {
-    // Cleanup old pending queries (timeout after 5 seconds)
-    uint32_t now = millis();
-    auto it = pending_queries_.begin();
-    while (it != pending_queries_.end()) {
-      if (now - it->second.timestamp > 5000) {
-        it = pending_queries_.erase(it);
-      } else {
-        ++it;
+    uint32_t start = dns_micros();
+    if (benchmark_done_.exchange(false)) publish_benchmark();
+    if (adaptive_ps_) update_power_save();
+    if (last_query_text_sensor_ != nullptr) publish_last_query();
+    if (!stat_sensors_.empty()) publish_stats(start);
+    if (heap_guard_.enabled() && is_running()) check_heap();  // After setup_udp() sized the guard
+#ifdef USE_DNS_PROXY_MDNS
+    if (mdns_bridge_enabled_ && mdns_.poll() && !mdns_scheduled_.exchange(true)) {
+      if (tcpip_callback([](void *arg) {
+            DnsRedirect *self = static_cast<DnsRedirect *>(arg);
+            self->mdns_scheduled_ = false;
+            self->deliver_mdns_results();
+          }, this) != ERR_OK) {
+        mdns_scheduled_ = false;
       }
     }
+#endif
+
+    // Timers and cache reclaim run on the tcpip thread, which owns the pending
+    // pool and the cache, one budgeted slice per loop() at most. A slice that
+    // runs out of budget asks for the next one right away.
+    uint32_t now = dns_millis();
+    bool due = maintenance_more_ || heap_changed_ || (pending_active_ != 0 && now - last_sweep_ >= TIMER_INTERVAL_MS) ||
+               (cache_.enabled() && now - last_reap_ >= CACHE_REAP_INTERVAL_MS);
+    if (!due || sweep_scheduled_.exchange(true)) return;
+
+    if (tcpip_callback([](void *arg) {
+          DnsRedirect *self = static_cast<DnsRedirect *>(arg);
+          self->run_maintenance();
+          self->sweep_scheduled_ = false;
+        }, this) != ERR_OK) {
+      sweep_scheduled_ = false;
+    }
   }
 
   float get_setup_priority() const override { return setup_priority::AFTER_WIFI; }
 
-  void get_wifi_dns_server() {
-    esp_netif_t* netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
-    if (netif != nullptr) {
-      esp_netif_dns_info_t dns_info;
-      if (esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns_info) == ESP_OK) {
-        // Convert esp_ip_addr_t to lwip ip_addr_t
-        if (dns_info.ip.type == ESP_IPADDR_TYPE_V4) {
-          ip_addr_set_ip4_u32(&upstream_dns_, dns_info.ip.u_addr.ip4.addr);
-          has_upstream_dns_ = true;
-
-          uint32_t dns_addr = dns_info.ip.u_addr.ip4.addr;
-          ESP_LOGI("dns_proxy", "Using upstream DNS: %d.%d.%d.%d",
-                   (dns_addr >> 0) & 0xFF, (dns_addr >> 8) & 0xFF,
-                   (dns_addr >> 16) & 0xFF, (dns_addr >> 24) & 0xFF);
-        } else {
-          has_upstream_dns_ = false;
-          ESP_LOGW("dns_proxy", "IPv6 DNS not supported - forwarding disabled");
-        }
-      } else {
-        has_upstream_dns_ = false;
-        ESP_LOGW("dns_proxy", "Could not get WiFi DNS - forwarding disabled");
+  // Formats one log entry as "name TYPE from client: outcome (latency)".
+  static void format_recent_query(const RecentQuery &entry, char *buf, size_t cap) {
+    char type_buf[12];
+    snprintf(buf, cap, "%s %s from %u.%u.%u.%u: %s (%u us)", entry.name,
+             dns_type_to_string(entry.qtype, type_buf, sizeof(type_buf)), (unsigned) (entry.client & 0xFF),
+             (unsigned) ((entry.client >> 8) & 0xFF), (unsigned) ((entry.client >> 16) & 0xFF),
+             (unsigned) ((entry.client >> 24) & 0xFF), query_outcome_to_string(entry.outcome),
+             (unsigned) entry.latency_us);
+  }
+
+  // Publishes the newest finished query, at most once per second.
+  void publish_last_query() {
+    uint32_t now = dns_millis();
+    if (now - last_query_published_ms_ < 1000) return;
+
+    RecentQuery entry;
+    for (uint8_t age = 0; get_recent_query(age, entry); age++) {
+      if (entry.outcome == QueryOutcome::PENDING) continue;
+      if (entry.serial != last_query_published_) {
+        char buf[RECENT_NAME_MAX + 64];
+        format_recent_query(entry, buf, sizeof(buf));
+        last_query_text_sensor_->publish_state(buf);
+        last_query_published_ = entry.serial;
+        last_query_published_ms_ = now;
       }
-    } else {
-      has_upstream_dns_ = false;
-      ESP_LOGW("dns_proxy", "Could not get WiFi interface - forwarding disabled");
+      break;
     }
   }
 
+  void dump_recent_queries() {
+    RecentQuery entry;
+    char buf[RECENT_NAME_MAX + 64];
+    for (uint8_t age = 0; get_recent_query(age, entry); age++) {
+      format_recent_query(entry, buf, sizeof(buf));
+      ESP_LOGI("dns_proxy", "#%u %s", (unsigned) entry.serial, buf);
+    }
+  }
+
+  // Number of records that have not answered a single query since boot.
+  uint32_t get_unused_rule_count() const {
+    uint32_t count = 0;
+    for (const auto &stats : rule_stats_) count += stats.hits == 0;
+    return count;
+  }
+  const RuleStats *get_rule_stats(uint16_t rule) const {
+    return rule < rule_stats_.size() ? &rule_stats_[rule] : nullptr;
+  }
+
+  // Logs the `top` most used records and every record that was never hit.
+  // Record names live in the arena, so the report is written from the tcpip
+  // thread.
+  void dump_rule_stats(uint8_t top) {
+    if (udp_pcb_ == nullptr) return;
+    rule_report_top_ = top < RULE_REPORT_MAX ? top : RULE_REPORT_MAX;
+    tcpip_callback([](void *arg) { static_cast<DnsRedirect *>(arg)->report_rules_on_tcpip(); }, this);
+  }
+
+  // Walks the stat sensors every STAT_CHECK_INTERVAL_MS; a pass that exceeds
+  // the loop's budget continues in the next loop().
+  void publish_stats(uint32_t start) {
+    uint32_t now = dns_millis();
+    if (stat_cursor_ == 0) {
+      if (now - last_stat_check_ < STAT_CHECK_INTERVAL_MS) return;
+      last_stat_check_ = now;
+      latency_window_.update(upstream_latency_, now);
+    }
+    while (stat_cursor_ < stat_sensors_.size()) {
+      StatSensor &stat = stat_sensors_[stat_cursor_++];
+      stat.update(read_stat(stat.stat), now);
+      if (!within_budget(start)) break;
+    }
+    if (stat_cursor_ == stat_sensors_.size()) stat_cursor_ = 0;
+  }
+
+  bool within_budget(uint32_t start) const { return dns_micros() - start < maintenance_budget_us_; }
+
+  float read_stat(Stat stat) const {
+    switch (stat) {
+      case Stat::QUERIES:
+        return query_count_;
+      case Stat::FORWARDED:
+        return forwarded_count_;
+      case Stat::FAST_PATH:
+        return fast_path_count_;
+      case Stat::TIMEOUTS:
+        return timeout_count_;
+      case Stat::DROPPED:
+        return dropped_count_;
+      case Stat::PENDING:
+        return pending_active_;
+      case Stat::CACHE_HITS:
+        return cache_.get_hits();
+      case Stat::CACHE_MISSES:
+        return cache_.get_misses();
+      case Stat::CACHE_ENTRIES:
+        return cache_.size();
+      case Stat::QPS_1M:
+        return get_qps_1m();
+      case Stat::QPS_15M:
+        return get_qps_15m();
+      case Stat::HIT_RATIO_1M:
+        return get_hit_ratio_1m();
+      case Stat::FORWARD_RATIO_1M:
+        return get_forward_ratio_1m();
+      case Stat::LATENCY_P50:
+        return get_upstream_latency_percentile(0.50f);
+      case Stat::LATENCY_P90:
+        return get_upstream_latency_percentile(0.90f);
+      case Stat::LATENCY_P99:
+        return get_upstream_latency_percentile(0.99f);
+    }
+    return NAN;
+  }
+
+  void report_rules_on_tcpip() {
+    // Top rules by insertion into a small sorted array; nothing is allocated
+    uint16_t top[RULE_REPORT_MAX];
+    uint8_t count = 0;
+    for (uint16_t i = 0; i < rule_stats_.size(); i++) {
+      if (rule_stats_[i].hits == 0) continue;
+      uint8_t pos = count < rule_report_top_ ? count++ : rule_report_top_;
+      while (pos > 0 && rule_stats_[top[pos - 1]].hits < rule_stats_[i].hits) {
+        if (pos < rule_report_top_) top[pos] = top[pos - 1];
+        pos--;
+      }
+      if (pos < rule_report_top_) top[pos] = i;
+    }
+
+    uint32_t now = dns_millis();
+    char name[DNS_MAX_NAME + 3];
+    ESP_LOGI("dns_proxy", "Top %u of %u records:", count, (unsigned) local_records_.size());
+    for (uint8_t i = 0; i < count; i++) {
+      const RuleStats &stats = rule_stats_[top[i]];
+      format_rule(top[i], name, sizeof(name));
+      ESP_LOGI("dns_proxy", "  %-40s %8u hits, last %us ago", name, (unsigned) stats.hits,
+               (unsigned) ((now - stats.last_hit_ms) / 1000));
+    }
+
+    uint32_t unused = get_unused_rule_count();
+    ESP_LOGI("dns_proxy", "%u records never hit:", (unsigned) unused);
+    for (uint16_t i = 0; i < rule_stats_.size(); i++) {
+      if (rule_stats_[i].hits != 0) continue;
+      format_rule(i, name, sizeof(name));
+      ESP_LOGI("dns_proxy", "  %s", name);
+    }
+  }
+
+  void format_rule(uint16_t rule, char *out, size_t cap) {
+    const LocalRecord &record = local_records_[rule];
+    size_t n = 0;
+    if (record.wildcard) {
+      out[n++] = '*';
+      out[n++] = '.';
+    }
+    dns_name_to_text(names_.name(record.name), out + n, cap - n);
+  }
+
+  // Keeps the radio awake while clients are querying (modem sleep adds tens of
+  // milliseconds per reply) and hands control back after a quiet period.
+  void update_power_save() {
+    uint32_t now = dns_millis();
+    uint32_t queries = query_count_;
+
+    if (queries - ps_window_count_ >= ps_active_queries_) {
+      ps_last_active_ = now;
+      ps_window_count_ = queries;
+      if (!ps_suspended_ && dns_power_save_suspend(&ps_saved_mode_)) {
+        ps_suspended_ = true;
+        ps_transitions_++;
+        ESP_LOGD("dns_proxy", "DNS traffic - modem sleep disabled");
+      }
+    } else if (now - ps_window_start_ >= 1000) {
+      // Rate is measured over one-second windows
+      ps_window_start_ = now;
+      ps_window_count_ = queries;
+    }
+
+    if (ps_suspended_ && now - ps_last_active_ >= ps_quiet_period_) {
+      if (dns_power_save_restore(ps_saved_mode_)) {
+        ps_suspended_ = false;
+        ps_transitions_++;
+        ESP_LOGD("dns_proxy", "DNS quiet - modem sleep restored");
+      }
+    }
+  }
+
+  void get_wifi_dns_server() {
+    has_upstream_dns_ = dns_platform_upstream(&upstream_dns_);
+    if (has_upstream_dns_) {
+      uint32_t dns_addr = ip4_addr_get_u32(ip_2_ip4(&upstream_dns_));
+      ESP_LOGI("dns_proxy", "Using upstream DNS: %d.%d.%d.%d",
+               (dns_addr >> 0) & 0xFF, (dns_addr >> 8) & 0xFF,
+               (dns_addr >> 16) & 0xFF, (dns_addr >> 24) & 0xFF);
+    }
+  }
+
+
   void setup_udp() {
+    // Allocate the whole pending pool up front; nothing on the query path
+    // allocates slots afterwards.
+    pending_queries_.resize(max_pending_);
+    fair_queue_.init(max_pending_);
+    pending_limit_ = max_pending_;
+
+    // One arena for every stored name: records, cache entries and delegations
+    uint32_t name_cells = 32 + records_.size() * 2 + cache_size_ * 3 + (recursive_ ? INFRA_ZONES * 2 : 0);
+    if (!names_.init(name_cells < NAME_CELL_NONE ? name_cells : NAME_CELL_NONE - 1)) {
+      ESP_LOGE("dns_proxy", "Could not allocate name arena");
+      mark_failed();
+      return;
+    }
+    intern_records();
+
+    if (cache_size_ > 0 && !cache_.init(cache_size_, &names_, hot_cache_size_)) {
+      ESP_LOGW("dns_proxy", "Could not allocate cache for %d entries - caching disabled", cache_size_);
+    }
+    heap_guard_.set_reclaim(cache_.hot_bytes());
+
+    if (recursive_) {
+      contexts_ = static_cast<RecursionContext *>(dns_alloc_large(sizeof(RecursionContext) * max_pending_));
+      if (contexts_ == nullptr || !infra_.init(&names_)) {
+        ESP_LOGE("dns_proxy", "Could not allocate recursion state - falling back to forwarding");
+        recursive_ = false;
+      }
+      // calloc leaves parent at 0, which would name pending slot 0
+      for (uint16_t i = 0; contexts_ != nullptr && i < max_pending_; i++) contexts_[i].parent = RECURSION_NO_PARENT;
+    }
+
     // Server PCB (port 53)
     udp_pcb_ = udp_new();
     if (udp_pcb_ == nullptr) {
@@ -120,8 +588,8 @@ class DnsRedirect : public Component {
 
     udp_recv(udp_pcb_, &DnsRedirect::udp_recv_callback, this);
 
-    // Client PCB for forwarding (only if we have upstream DNS)
-    if (has_upstream_dns_) {
+    // Client PCB for forwarding (only if we have upstream DNS or resolve ourselves)
+    if (has_upstream_dns_ || recursive_) {
       client_pcb_ = udp_new();
       if (client_pcb_ == nullptr) {
         ESP_LOGE("dns_proxy", "Failed to create client UDP PCB");
@@ -130,18 +598,59 @@ class DnsRedirect : public Component {
       }
 
       udp_recv(client_pcb_, &DnsRedirect::udp_forward_callback, this);
-      ESP_LOGI("dns_proxy", "DNS proxy started on port 53 with forwarding");
+      ESP_LOGI("dns_proxy", "DNS proxy started on port 53 with %s",
+               recursive_ ? "recursive resolution" : "forwarding");
     } else {
       ESP_LOGI("dns_proxy", "DNS server started on port 53 (local records only)");
     }
 
-    ESP_LOGI("dns_proxy", "Configured %d DNS records", records_.size());
+    ESP_LOGI("dns_proxy", "Configured %d DNS records", local_records_.size());
+  }
+
+  // Moves the configured records into the arena; the text copies are freed.
+  void intern_records() {
+    local_records_.reserve(records_.size());
+    for (const auto &record : records_) {
+      bool wildcard = record.first.compare(0, 2, "*.") == 0;
+      size_t skip = wildcard ? 2 : 0;
+      uint8_t name[DNS_MAX_NAME + 1];
+      NameHandle handle = NAME_NONE;
+      if (dns_encode_name(record.first.data() + skip, record.first.size() - skip, name) > 1) {
+        handle = names_.intern(name);
+      }
+      if (handle == NAME_NONE) {
+        ESP_LOGW("dns_proxy", "Ignoring record with invalid name: %s", record.first.c_str());
+        continue;
+      }
+      if (record.second == 0) {
+        ESP_LOGW("dns_proxy", "Record %s has no valid IP - its queries are forwarded", record.first.c_str());
+      }
+      uint16_t slot = names_.tag(handle);
+      if (slot == NAME_TAG_NONE) {
+        slot = rule_slots_.size();
+        names_.set_tag(handle, slot);
+        rule_slots_.push_back(RuleSlot{RULE_NONE, RULE_NONE});
+      }
+      uint16_t &rule = wildcard ? rule_slots_[slot].wildcard : rule_slots_[slot].exact;
+      if (rule == RULE_NONE) {
+        rule = local_records_.size();
+        // Only the record both paths use; ip 0 stays out, see add()
+        if (!wildcard) local_answers_.add(names_.name(handle), record.second, rule);
+      }
+      local_records_.push_back(LocalRecord{handle, record.second, wildcard});
+    }
+    local_answers_.build();
+    rule_stats_.assign(local_records_.size(), RuleStats{0, 0});
+    std::map<std::string, uint32_t>().swap(records_);
   }
 
   static void udp_recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
                                  const ip_addr_t *addr, u16_t port) {
     DnsRedirect *self = static_cast<DnsRedirect *>(arg);
     if (p != nullptr) {
+#ifdef USE_DNS_PROXY_CAPTURE
+      self->capture_packet(p, addr, port, pcb->local_port, false);
+#endif
       self->handle_dns_request(pcb, p, addr, port);
       pbuf_free(p);
     }
@@ -151,6 +660,9 @@ class DnsRedirect : public Component {
                                    const ip_addr_t *addr, u16_t port) {
     DnsRedirect *self = static_cast<DnsRedirect *>(arg);
     if (p != nullptr) {
+#ifdef USE_DNS_PROXY_CAPTURE
+      self->capture_packet(p, addr, port, pcb->local_port, false);
+#endif
       self->handle_forwarded_response(pcb, p, addr, port);
       pbuf_free(p);
     }
@@ -161,287 +673,1553 @@ class DnsRedirect : public Component {
     if (p->len < 12) return;
 
     uint8_t *data = static_cast<uint8_t *>(p->payload);
+    if (answer_local_fast(pcb, data, p->len, addr, port)) return;
 
-    // Parse query name
-    std::string query_name = parse_dns_name(data + 12, p->len - 12);
     uint16_t transaction_id = (data[0] << 8) | data[1];
+    uint32_t start_us = dns_micros();
 
     query_count_++;
-    last_query_ = query_name;
+    count_metric(Metric::QUERIES);
+    current_log_ = QUERY_LOG_NONE;
+    if (!benchmark_running_) {
+      current_log_ = query_log_.add(data, p->len, IP_IS_V4(addr) ? ip4_addr_get_u32(ip_2_ip4(addr)) : 0, dns_millis());
+    }
 
-    ESP_LOGD("dns_proxy", "DNS query for: %s (ID: %04x)", query_name.c_str(), transaction_id);
+    // Everything below walks the QNAME as a plain wire name
+    size_t name_end;
+    uint16_t qtype;
+    if (!dns_parse_question(data, p->len, &name_end, &qtype)) {
+      send_error_response(data, p->len, pcb, addr, port, DNS_RCODE_FORMERR);
+      query_log_.complete(current_log_, QueryOutcome::FORMERR, dns_micros() - start_us);
+      return;
+    }
+
+#if ESPHOME_LOG_LEVEL >= ESPHOME_LOG_LEVEL_DEBUG
+    char query_name[DNS_MAX_NAME + 1];
+    dns_name_to_text(data + DNS_HEADER_SIZE, query_name, sizeof(query_name));
+    ESP_LOGD("dns_proxy", "DNS query for: %s (ID: %04x)", query_name, transaction_id);
+#endif
 
     // Check if we have a local record
-    uint32_t reply_ip = get_reply_ip(query_name);
+    uint16_t rule = find_rule(data + DNS_HEADER_SIZE);
+    uint32_t reply_ip = rule != RULE_NONE ? local_records_[rule].ip : 0;
 
     if (reply_ip != 0) {
       // We have a local record - respond directly
-      std::vector<uint8_t> response;
-      build_dns_response(data, p->len, reply_ip, response);
-
-      struct pbuf *out = pbuf_alloc(PBUF_TRANSPORT, response.size(), PBUF_RAM);
-      if (out != nullptr) {
-        memcpy(out->payload, response.data(), response.size());
-        udp_sendto(pcb, out, addr, port);
-        pbuf_free(out);
-
+      if (send_packet(pcb, scratch_, build_dns_response(data, p->len, reply_ip), addr, port)) {
         ESP_LOGD("dns_proxy", "Local response: %d.%d.%d.%d",
                  (reply_ip >> 0) & 0xFF, (reply_ip >> 8) & 0xFF,
                  (reply_ip >> 16) & 0xFF, (reply_ip >> 24) & 0xFF);
       }
+      query_log_.complete(current_log_, QueryOutcome::LOCAL, dns_micros() - start_us);
+      count_metric(Metric::LOCAL_HITS);
+      count_rule_hit(rule);
+    } else if (answer_from_cache(pcb, data, p->len, addr, port)) {
+      ESP_LOGD("dns_proxy", "Cached response (ID: %04x)", transaction_id);
+      query_log_.complete(current_log_, QueryOutcome::CACHED, dns_micros() - start_us);
+      count_metric(Metric::CACHE_HITS);
+#ifdef USE_DNS_PROXY_MDNS
+    } else if (mdns_bridge_enabled_ && is_local_name(data, p->len)) {
+      // Never forwarded: answer from the LAN via mDNS
+      start_mdns_lookup(data, p->len, addr, port, transaction_id);
+#endif
+    } else if (recursive_) {
+      // Resolve iteratively from the root
+      start_recursion(data, p->len, addr, port, transaction_id);
     } else if (has_upstream_dns_) {
       // Forward to upstream DNS if available
       forward_query(data, p->len, addr, port, transaction_id);
     } else {
       // No local record and no upstream DNS - send NXDOMAIN
-      send_nxdomain_response(data, p->len, pcb, addr, port);
+      send_error_response(data, p->len, pcb, addr, port, DNS_RCODE_NXDOMAIN);
+      query_log_.complete(current_log_, QueryOutcome::NXDOMAIN, dns_micros() - start_us);
     }
   }
 
-  void forward_query(uint8_t *data, size_t len, const ip_addr_t *client_addr,
-                     u16_t client_port, uint16_t original_id) {
-    // Generate new transaction ID for upstream query
-    uint16_t new_id = esp_random() & 0xFFFF;
+  // Exact-match A queries for local records: the reply comes straight from
+  // the prebuilt table, skipping name parsing and response assembly.
+  bool answer_local_fast(struct udp_pcb *pcb, const uint8_t *data, size_t len, const ip_addr_t *addr, u16_t port) {
+    if (len + LOCAL_ANSWER_RR_SIZE > sizeof(scratch_)) return false;
+    uint16_t rule;
+    size_t n = local_answers_.answer(data, len, scratch_, &rule);
+    if (n == 0) return false;
+
+    uint32_t start_us = dns_micros();
+    query_count_++;
+    fast_path_count_++;
+    count_metric(Metric::QUERIES);
+    count_metric(Metric::LOCAL_HITS);
+    count_rule_hit(rule);
+    uint32_t log = benchmark_running_ ? QUERY_LOG_NONE
+                                      : query_log_.add(data, len, IP_IS_V4(addr) ? ip4_addr_get_u32(ip_2_ip4(addr)) : 0,
+                                                       dns_millis());
+    send_packet(pcb, scratch_, n, addr, port);
+    query_log_.complete(log, QueryOutcome::LOCAL, dns_micros() - start_us);
+    return true;
+  }
+
+  bool answer_from_cache(struct udp_pcb *pcb, const uint8_t *data, size_t len,
+                         const ip_addr_t *addr, u16_t port) {
+    if (!cache_.enabled()) return false;
+
+    size_t name_end;
+    uint16_t qtype;
+    if (!dns_parse_question(data, len, &name_end, &qtype)) return false;
 
-    // Store pending query
-    PendingQuery pending;
+    uint32_t now = dns_millis();
+    const CacheEntry *entry = cache_.lookup(data + DNS_HEADER_SIZE, qtype, now);
+    if (entry == nullptr) return false;
+
+    struct pbuf *out = pbuf_alloc(PBUF_TRANSPORT, entry->len, PBUF_RAM);
+    if (out == nullptr) return false;
+    cache_.build_reply(*entry, data, static_cast<uint8_t *>(out->payload), now);
+    transmit(pcb, out, addr, port);
+    pbuf_free(out);
+    return true;
+  }
+
+  // Claims a pending slot for a client query, or answers SERVFAIL if the
+  // query is too large or the pool is exhausted.
+  PendingQuery *accept_pending(const uint8_t *data, size_t len, const ip_addr_t *client_addr,
+                               u16_t client_port, uint16_t original_id) {
+    if (len > MAX_QUERY_SIZE) {
+      // Slots hold a classic 512-byte query; larger ones (heavy EDNS padding) aren't forwarded
+      ESP_LOGW("dns_proxy", "Query of %u bytes too large to forward (ID: %04x)", (unsigned) len, original_id);
+      send_error_response(data, len, udp_pcb_, client_addr, client_port, DNS_RCODE_SERVFAIL);
+      query_log_.complete(current_log_, QueryOutcome::SERVFAIL, 0);
+      return nullptr;
+    }
+    PendingQuery *pending = acquire_pending();
+    if (pending == nullptr) {
+      // Pool exhausted - shed the query instead of growing
+      dropped_count_++;
+      count_metric(Metric::SHEDS);
+      ESP_LOGW("dns_proxy", "Pending pool full%s, dropping query (ID: %04x)",
+               pending_limit_ < max_pending_ ? " (heap pressure)" : "", original_id);
+      send_error_response(data, len, udp_pcb_, client_addr, client_port, DNS_RCODE_SERVFAIL);
+      query_log_.complete(current_log_, QueryOutcome::DROPPED, 0);
+      return nullptr;
+    }
+
+    attach_client(*pending, data, client_addr, client_port, original_id);
+    pending->attempts = 0;
+    return pending;
+  }
+
+  void attach_client(PendingQuery &pending, const uint8_t *data, const ip_addr_t *client_addr,
+                     u16_t client_port, uint16_t original_id) {
+    pending.has_client = true;
     pending.client_addr = *client_addr;
     pending.client_port = client_port;
     pending.transaction_id = original_id;
-    pending.timestamp = millis();
-    pending_queries_[new_id] = pending;
+    pending.client_flags = data[2];
+    pending.log_serial = current_log_;
+    pending.timestamp = dns_millis();
+  }
 
-    // Modify transaction ID in query
-    data[0] = (new_id >> 8) & 0xFF;
-    data[1] = new_id & 0xFF;
+  void forward_query(uint8_t *data, size_t len, const ip_addr_t *client_addr,
+                     u16_t client_port, uint16_t original_id) {
+    if (prefetch_siblings_ && !benchmark_running_ && join_prefetch(data, len, client_addr, client_port, original_id)) {
+      return;
+    }
 
-    // Forward to upstream DNS
-    struct pbuf *forward_p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
-    if (forward_p != nullptr) {
-      memcpy(forward_p->payload, data, len);
+    PendingQuery *pending = accept_pending(data, len, client_addr, client_port, original_id);
+    if (pending == nullptr) return;
+
+    pending->server = upstream_dns_;
+    pending->query_len = len;
+    memcpy(pending->query, data, len);
+
+    // A benchmark miss ends here: nothing is queued or sent
+    if (benchmark_running_) {
+      release_pending(*pending);
+      return;
+    }
 
-      err_t err = udp_sendto(client_pcb_, forward_p, &upstream_dns_, 53);
+    // Wait behind queries already queued, or for a free upstream slot
+    if (!fair_queue_.empty() || upstream_inflight_ >= max_upstream_) {
+      enqueue_upstream(*pending);
+      return;
+    }
+    start_forward(*pending);
+  }
+
+  void start_forward(PendingQuery &pending) {
+    if (send_upstream(pending)) {
+      forwarded_count_++;
+      count_metric(Metric::FORWARDS);
+      pending.state = ResolveState::AWAIT_UPSTREAM;
+      upstream_inflight_++;
+      ESP_LOGD("dns_proxy", "Forwarded query (ID: %04x -> %04x)", pending.transaction_id, pending.upstream_id);
+      if (prefetch_siblings_ && cache_.enabled()) prefetch_siblings(pending.query, pending.query_len);
+    } else {
+      // Never left the device; don't leave the client waiting for a timeout
+      if (pending.has_client) {
+        restore_client_id(pending, pending.query);
+        send_error_response(pending.query, pending.query_len, udp_pcb_, &pending.client_addr, pending.client_port,
+                            DNS_RCODE_SERVFAIL);
+        query_log_.complete(pending.log_serial, QueryOutcome::SERVFAIL, elapsed_us(pending));
+      }
+      release_pending(pending);
+    }
+  }
+
+  // --- Upstream fair queueing -----------------------------------------------
+
+  // Parks a forward in its client's queue until dispatch_upstream() finds
+  // capacity. It gives up after upstream_timeout like a sent query would.
+  void enqueue_upstream(PendingQuery &pending) {
+    uint32_t client = IP_IS_V4(&pending.client_addr) ? ip4_addr_get_u32(ip_2_ip4(&pending.client_addr)) : 0;
+    uint16_t waiting = fair_queue_.push(client, &pending - pending_queries_.data(), pending.query_len);
+    pending.queue_class = waiting == 0 ? QueueClass::QUIET : QueueClass::BUSY;
+    pending.state = ResolveState::QUEUED;
+    pending.deadline = dns_millis() + upstream_timeout_;
+    upstream_queued_++;
+  }
+
+  // Sends queued forwards in DRR order while upstream slots are free.
+  void dispatch_upstream() {
+    uint32_t now = dns_millis();
+    while (upstream_inflight_ < max_upstream_ && !fair_queue_.empty()) {
+      PendingQuery &pending = pending_queries_[fair_queue_.pop()];
+      upstream_queued_--;
+      queue_delay_[static_cast<uint8_t>(pending.queue_class)].record(now - pending.timestamp);
+      start_forward(pending);
+    }
+  }
+
+  // --- Sibling prefetch -----------------------------------------------------
+
+  static bool is_sibling_type(uint16_t qtype) {
+    for (uint16_t type : SIBLING_TYPES) {
+      if (type == qtype) return true;
+    }
+    return false;
+  }
+
+  // A, AAAA and HTTPS for one name usually arrive within milliseconds of each
+  // other. Sends the other two upstream as soon as the first is forwarded, so
+  // the follow-ups find them in the cache or join the lookup in flight.
+  // Prefetches have no client, are not retried and only use the lower half
+  // of the pending pool.
+  void prefetch_siblings(const uint8_t *data, size_t len) {
+    size_t name_end;
+    uint16_t qtype;
+    if (!dns_parse_question(data, len, &name_end, &qtype) || !is_sibling_type(qtype)) return;
+    const uint8_t *name = data + DNS_HEADER_SIZE;
+    uint32_t now = dns_millis();
+
+    for (uint16_t sibling : SIBLING_TYPES) {
+      if (sibling == qtype || cache_.contains(name, sibling, now) || find_upstream(name, sibling) != nullptr) continue;
+      // Never queued: they would only delay real queries
+      if (pending_active_ * 2 >= max_pending_ || upstream_inflight_ >= max_upstream_ ||
+          heap_pressure_ != HeapPressure::NONE) {
+        return;
+      }
+      PendingQuery *pending = acquire_pending();
+      if (pending == nullptr) return;
+
+      // Bare question: same name, sibling type, no EDNS
+      size_t n = name_end + 4;
+      memcpy(pending->query, data, n);
+      pending->query[2] = DNS_FLAG_RD;
+      pending->query[3] = 0;
+      dns_write_u16(pending->query + 4, 1);
+      dns_write_u16(pending->query + 6, 0);
+      dns_write_u16(pending->query + 8, 0);
+      dns_write_u16(pending->query + 10, 0);
+      dns_write_u16(pending->query + name_end, sibling);
+      pending->query_len = n;
+      pending->has_client = false;
+      pending->log_serial = QUERY_LOG_NONE;
+      pending->timestamp = now;
+      pending->server = upstream_dns_;
+      pending->attempts = upstream_retries_;  // The first send uses up the retries
+
+      if (send_upstream(*pending)) {
+        pending->state = ResolveState::AWAIT_UPSTREAM;
+        upstream_inflight_++;
+        prefetch_count_++;
+      } else {
+        release_pending(*pending);
+        return;
+      }
+    }
+  }
+
+  // Forwarded lookup in flight for exactly this name and type, if any.
+  PendingQuery *find_upstream(const uint8_t *name, uint16_t qtype) {
+    for (auto &pending : pending_queries_) {
+      if (pending.state != ResolveState::AWAIT_UPSTREAM) continue;
+      size_t name_end;
+      uint16_t type;
+      if (dns_parse_question(pending.query, pending.query_len, &name_end, &type) && type == qtype &&
+          dns_name_equal(pending.query + DNS_HEADER_SIZE, name)) {
+        return &pending;
+      }
+    }
+    return nullptr;
+  }
+
+  // Hands a prefetch still waiting for its answer to the client asking for it.
+  bool join_prefetch(const uint8_t *data, size_t len, const ip_addr_t *client_addr, u16_t client_port,
+                     uint16_t original_id) {
+    size_t name_end;
+    uint16_t qtype;
+    if (!dns_parse_question(data, len, &name_end, &qtype) || !is_sibling_type(qtype)) return false;
+    PendingQuery *pending = find_upstream(data + DNS_HEADER_SIZE, qtype);
+    if (pending == nullptr || pending->has_client) return false;
+
+    attach_client(*pending, data, client_addr, client_port, original_id);
+    pending->attempts = 1;  // The client's query gets the usual retries
+    forwarded_count_++;
+    count_metric(Metric::FORWARDS);
+    ESP_LOGD("dns_proxy", "Joined prefetch (ID: %04x -> %04x)", original_id, pending->upstream_id);
+    return true;
+  }
+
+  // Sends (or resends) the stored query to pending.server under a fresh
+  // transaction ID and arms the slot's deadline.
+  bool send_upstream(PendingQuery &pending) {
+    // Nothing leaves the device during a self-benchmark (forwards stop before this)
+    if (benchmark_running_) return false;
+
+    pending.upstream_id = new_upstream_id();
+    pending.query[0] = (pending.upstream_id >> 8) & 0xFF;
+    pending.query[1] = pending.upstream_id & 0xFF;
+    pending.attempts++;
+    pending.deadline = dns_millis() + upstream_timeout_;
+
+    err_t err = ERR_MEM;
+    struct pbuf *forward_p = pbuf_alloc(PBUF_TRANSPORT, pending.query_len, PBUF_RAM);
+    if (forward_p != nullptr) {
+      pbuf_take(forward_p, pending.query, pending.query_len);
+#ifdef USE_DNS_PROXY_CAPTURE
+      capture_packet(forward_p, &pending.server, 53, client_pcb_->local_port, true);
+#endif
+      err = udp_sendto(client_pcb_, forward_p, &pending.server, 53);
       pbuf_free(forward_p);
+    }
+
+    if (err != ERR_OK) {
+      ESP_LOGW("dns_proxy", "Failed to forward query: %d", err);
+      return false;
+    }
+    return true;
+  }
+
+  // Drives one resolution forward. Every transition of a pending slot goes
+  // through here so multi-step flows stay in one place.
+  void resume(PendingQuery &pending, ResolveEvent event, const uint8_t *data, size_t len) {
+    switch (pending.state) {
+      case ResolveState::QUEUED:
+        // Never got an upstream slot in time
+        if (event == ResolveEvent::TIMEOUT) {
+          fair_queue_.remove(&pending - pending_queries_.data());
+          upstream_queued_--;
+          timeout_count_++;
+          count_metric(Metric::TIMEOUTS);
+          ESP_LOGD("dns_proxy", "Timed out in upstream queue (ID: %04x)", pending.transaction_id);
+          fail_pending(pending);
+        }
+        break;
+
+      case ResolveState::AWAIT_UPSTREAM:
+        if (event == ResolveEvent::RESPONSE) {
+          if (dns_question_matches(pending.query, pending.query_len, data, len)) {
+            cache_.insert(data, len, dns_millis());
+          }
+          if (pending.has_client) complete_to_client(pending, data, len);
+          release_pending(pending);
+        } else if (pending.attempts <= upstream_retries_ && send_upstream(pending)) {
+          ESP_LOGD("dns_proxy", "Retrying query (ID: %04x, attempt %d)",
+                   pending.transaction_id, pending.attempts);
+        } else {
+          // An unanswered prefetch is dropped silently
+          if (pending.has_client) {
+            timeout_count_++;
+            count_metric(Metric::TIMEOUTS);
+            ESP_LOGD("dns_proxy", "Upstream timeout (ID: %04x)", pending.transaction_id);
+          }
+          fail_pending(pending);
+        }
+        break;
+
+      case ResolveState::AWAIT_AUTHORITY:
+        if (event == ResolveEvent::RESPONSE) {
+          handle_authority_response(pending, data, len);
+        } else {
+          RecursionContext &ctx = context_of(pending);
+          infra_.record_timeout(ctx.server, dns_millis());
+          if (pending.attempts < RECURSION_MAX_TRIES && send_iterative(pending, ctx.server)) {
+            ESP_LOGD("dns_proxy", "Authority timeout, trying another server (ID: %04x)", pending.transaction_id);
+          } else {
+            timeout_count_++;
+            count_metric(Metric::TIMEOUTS);
+            fail_pending(pending);
+          }
+        }
+        break;
+
+      case ResolveState::AWAIT_NS_ADDRESS:
+        // The child lookup resumes us directly; a timer event here means it
+        // never finished.
+        if (event == ResolveEvent::TIMEOUT) fail_pending(pending);
+        break;
+
+      case ResolveState::AWAIT_MDNS:
+#ifdef USE_DNS_PROXY_MDNS
+        // Results arrive through deliver_mdns_results(); nobody answered in time
+        if (event == ResolveEvent::TIMEOUT) {
+          ESP_LOGD("dns_proxy", "mDNS lookup timed out (ID: %04x)", pending.transaction_id);
+          send_error_response(pending.query, pending.query_len, udp_pcb_, &pending.client_addr,
+                              pending.client_port, DNS_RCODE_NXDOMAIN);
+          query_log_.complete(pending.log_serial, QueryOutcome::NXDOMAIN, elapsed_us(pending));
+          release_pending(pending);
+        }
+#endif
+        break;
+
+      case ResolveState::IDLE:
+        break;
+    }
+  }
+
+#ifdef USE_DNS_PROXY_LOCAL_RESOLVER
+  // --- Device resolver hook -------------------------------------------------
+
+  // Answers the device's own lookups from the local records or the cache.
+  // Called from application tasks; returns 0 if the name isn't known here.
+  uint32_t resolve_locally(const char *name);
 
-      if (err == ERR_OK) {
-        forwarded_count_++;
+  uint32_t local_address(const uint8_t *name) {
+    uint32_t ip = get_reply_ip(name);
+    if (ip != 0 || !cache_.enabled()) return ip;
+    const CacheEntry *entry = cache_.lookup(name, DNS_TYPE_A, dns_millis());
+    if (entry == nullptr || (entry->data[3] & 0x0F) != DNS_RCODE_NOERROR) return 0;
+    return dns_first_address(entry->data, entry->len);
+  }
+#endif
+
+#ifdef USE_DNS_PROXY_MDNS
+  // --- mDNS bridge ----------------------------------------------------------
+
+  // True for names ending in .local (RFC 6762 link-local names).
+  static bool is_local_name(const uint8_t *data, size_t len) {
+    static const uint8_t LOCAL[] = {5, 'l', 'o', 'c', 'a', 'l', 0};
+    size_t name_end;
+    uint16_t qtype;
+    if (!dns_parse_question(data, len, &name_end, &qtype)) return false;
+    const uint8_t *name = data + DNS_HEADER_SIZE;
+    return dns_label_count(name) >= 2 && dns_name_in_zone(name, LOCAL);
+  }
+
+  void start_mdns_lookup(const uint8_t *data, size_t len, const ip_addr_t *client_addr, u16_t client_port,
+                         uint16_t original_id) {
+    if (benchmark_running_) return;
+    size_t name_end;
+    uint16_t qtype;
+    dns_parse_question(data, len, &name_end, &qtype);
+
+    // Only host addresses can be bridged; other types get an empty answer
+    if (qtype != DNS_TYPE_A && qtype != DNS_TYPE_AAAA) {
+      send_error_response(data, len, udp_pcb_, client_addr, client_port, DNS_RCODE_NOERROR);
+      query_log_.complete(current_log_, QueryOutcome::MDNS, 0);
+      return;
+    }
+
+    // Host part as text, without ".local"
+    char host[MDNS_MAX_HOST];
+    size_t n = 0;
+    const uint8_t *name = data + DNS_HEADER_SIZE;
+    for (uint8_t labels = dns_label_count(name) - 1; labels > 0; labels--) {
+      uint8_t label = *name++;
+      if (n + label + 1 >= sizeof(host)) {
+        // Never look up a shortened name: another host could answer for it
+        ESP_LOGD("dns_proxy", "mDNS host name too long (ID: %04x)", original_id);
+        send_error_response(data, len, udp_pcb_, client_addr, client_port, DNS_RCODE_NXDOMAIN);
+        query_log_.complete(current_log_, QueryOutcome::NXDOMAIN, 0);
+        return;
+      }
+      if (n > 0) host[n++] = '.';
+      for (uint8_t i = 0; i < label; i++) host[n++] = dns_lower(*name++);
+    }
+    host[n] = '\0';
+
+    uint8_t lookup = mdns_.request(host, qtype);
+    if (lookup == MDNS_NO_LOOKUP) {
+      ESP_LOGW("dns_proxy", "Too many mDNS lookups in flight, dropping %s.local", host);
+      send_error_response(data, len, udp_pcb_, client_addr, client_port, DNS_RCODE_SERVFAIL);
+      query_log_.complete(current_log_, QueryOutcome::SERVFAIL, 0);
+      return;
+    }
+
+    PendingQuery *pending = accept_pending(data, len, client_addr, client_port, original_id);
+    if (pending == nullptr) return;
+    pending->query_len = len;
+    memcpy(pending->query, data, len);
+    restore_client_id(*pending, pending->query);
+    pending->mdns_lookup = lookup;
+    pending->deadline = dns_millis() + mdns_.get_timeout();
+    pending->state = ResolveState::AWAIT_MDNS;
+    ESP_LOGD("dns_proxy", "mDNS lookup for %s.local (ID: %04x)", host, original_id);
+  }
+
+  // Answers every client waiting on a finished lookup and caches the result.
+  void deliver_mdns_results() {
+    for (uint8_t i = 0; i < MDNS_MAX_LOOKUPS; i++) {
+      MdnsLookup &lookup = mdns_.lookup(i);
+      if (lookup.state.load(std::memory_order_acquire) != MdnsLookupState::DONE) continue;
+
+      bool cached = false;
+      for (auto &pending : pending_queries_) {
+        if (pending.state != ResolveState::AWAIT_MDNS || pending.mdns_lookup != i) continue;
+        size_t len = build_mdns_reply(pending.query, pending.query_len, pending.client_flags, lookup);
+        send_packet(udp_pcb_, scratch_, len, &pending.client_addr, pending.client_port);
+        if (!cached && lookup.address_count > 0) {
+          cache_.insert(scratch_, len, dns_millis());
+          cached = true;
+        }
+        query_log_.complete(pending.log_serial,
+                            lookup.address_count > 0 ? QueryOutcome::MDNS : QueryOutcome::NXDOMAIN,
+                            elapsed_us(pending));
+        release_pending(pending);
+      }
+      // Late results still warm the cache for the next query
+      if (!cached && lookup.address_count > 0) {
+        char text[MDNS_MAX_HOST + 8];
+        uint8_t query[DNS_HEADER_SIZE + MDNS_MAX_HOST + 12] = {0, 0, DNS_FLAG_RD, 0, 0, 1};
+        snprintf(text, sizeof(text), "%s.local", lookup.host);
+        size_t n = DNS_HEADER_SIZE + dns_encode_name(text, strlen(text), query + DNS_HEADER_SIZE);
+        if (n > DNS_HEADER_SIZE) {
+          dns_write_u16(query + n, lookup.qtype);
+          dns_write_u16(query + n + 2, DNS_CLASS_IN);
+          cache_.insert(scratch_, build_mdns_reply(query, n + 4, DNS_FLAG_RD, lookup), dns_millis());
+        }
+      }
+      mdns_.release(i);
+    }
+  }
+
+  // Assembles a reply to query in scratch_: one answer per address found, or
+  // NXDOMAIN if there were none.
+  size_t build_mdns_reply(const uint8_t *query, size_t query_len, uint8_t client_flags, const MdnsLookup &lookup) {
+    uint8_t *reply = scratch_;
+    size_t name_end;
+    uint16_t qtype;
+    dns_parse_question(query, query_len, &name_end, &qtype);
+    size_t n = name_end + 4;
+    memcpy(reply, query, n);
+    reply[2] = DNS_FLAG_QR | DNS_FLAG_AA | (client_flags & DNS_FLAG_RD);
+    reply[3] = DNS_FLAG_RA | (lookup.address_count > 0 ? DNS_RCODE_NOERROR : DNS_RCODE_NXDOMAIN);
+    dns_write_u16(reply + 4, 1);
+    dns_write_u16(reply + 6, lookup.address_count);
+    dns_write_u16(reply + 8, 0);
+    dns_write_u16(reply + 10, 0);
+    for (uint8_t i = 0; i < lookup.address_count; i++) {
+      dns_write_u16(reply + n, 0xC000 | DNS_HEADER_SIZE);  // Points at the question name
+      dns_write_u16(reply + n + 2, lookup.qtype);
+      dns_write_u16(reply + n + 4, DNS_CLASS_IN);
+      dns_write_u32(reply + n + 6, lookup.ttl);
+      dns_write_u16(reply + n + 10, lookup.address_len);
+      memcpy(reply + n + 12, lookup.addresses[i], lookup.address_len);
+      n += 12 + lookup.address_len;
+    }
+    return n;
+  }
+#endif
 
-        ESP_LOGD("dns_proxy", "Forwarded query (ID: %04x -> %04x)", original_id, new_id);
+  // Ends a resolution without an answer: SERVFAIL to the client, or failure
+  // propagated to the parent for internal lookups.
+  void fail_pending(PendingQuery &pending) {
+    if (pending.has_client) {
+      query_log_.complete(pending.log_serial, QueryOutcome::SERVFAIL, elapsed_us(pending));
+      if (pending.state == ResolveState::AWAIT_UPSTREAM || pending.state == ResolveState::QUEUED) {
+        restore_client_id(pending, pending.query);
+        send_error_response(pending.query, pending.query_len, udp_pcb_, &pending.client_addr,
+                            pending.client_port, DNS_RCODE_SERVFAIL);
       } else {
-        // Remove from pending on error
-        pending_queries_.erase(new_id);
-        ESP_LOGW("dns_proxy", "Failed to forward query: %d", err);
+        send_recursive_reply(pending, nullptr, 0, DNS_RCODE_SERVFAIL);
+      }
+    }
+    int16_t parent = contexts_ != nullptr ? context_of(pending).parent : RECURSION_NO_PARENT;
+    release_pending(pending);
+    if (parent != RECURSION_NO_PARENT) ns_address_resolved(pending_queries_[parent], 0);
+  }
+
+  // --- Iterative resolution -------------------------------------------------
+
+  RecursionContext &context_of(const PendingQuery &pending) { return contexts_[&pending - pending_queries_.data()]; }
+
+  void start_recursion(const uint8_t *data, size_t len, const ip_addr_t *client_addr,
+                       u16_t client_port, uint16_t original_id) {
+    size_t name_end;
+    uint16_t qtype;
+    if (!dns_parse_question(data, len, &name_end, &qtype)) {
+      send_error_response(data, len, udp_pcb_, client_addr, client_port, DNS_RCODE_SERVFAIL);
+      return;
+    }
+
+    PendingQuery *pending = accept_pending(data, len, client_addr, client_port, original_id);
+    if (pending == nullptr) return;
+    if (benchmark_running_) {
+      release_pending(*pending);
+      return;
+    }
+
+    RecursionContext &ctx = context_of(*pending);
+    ctx.parent = RECURSION_NO_PARENT;
+    ctx.qtype = qtype;
+    ctx.referrals = 0;
+    ctx.cnames = 0;
+    ctx.chain_count = 0;
+    ctx.chain_len = 0;
+    if (begin_iteration(*pending, data + DNS_HEADER_SIZE)) {
+      forwarded_count_++;
+      count_metric(Metric::FORWARDS);
+    } else {
+      fail_pending(*pending);
+    }
+  }
+
+  // Starts (or restarts, after a CNAME) the walk down from the closest known
+  // zone for name.
+  bool begin_iteration(PendingQuery &pending, const uint8_t *name) {
+    RecursionContext &ctx = context_of(pending);
+
+    // Iterative queries carry no RD bit and no EDNS
+    uint8_t *q = pending.query;
+    size_t name_len = dns_name_length(name);
+    memset(q, 0, DNS_HEADER_SIZE);
+    q[5] = 1;
+    memmove(q + DNS_HEADER_SIZE, name, name_len);
+    dns_write_u16(q + DNS_HEADER_SIZE + name_len, ctx.qtype);
+    dns_write_u16(q + DNS_HEADER_SIZE + name_len + 2, DNS_CLASS_IN);
+    pending.query_len = DNS_HEADER_SIZE + name_len + 4;
+
+    const InfraZone *zone = infra_.closest_zone(q + DNS_HEADER_SIZE, dns_millis());
+    if (zone != nullptr) {
+      ctx.zone_labels = dns_label_count(infra_.zone_name(*zone));
+      ctx.server_count = zone->server_count;
+      memcpy(ctx.servers, zone->servers, zone->server_count * sizeof(uint32_t));
+    } else {
+      // Start from a few random root servers
+      ctx.zone_labels = 0;
+      ctx.server_count = INFRA_MAX_SERVERS;
+      size_t roots = sizeof(ROOT_HINTS) / sizeof(ROOT_HINTS[0]);
+      for (uint8_t i = 0; i < INFRA_MAX_SERVERS; i++) {
+        const uint8_t *ip = ROOT_HINTS[dns_random() % roots];
+        ctx.servers[i] = ip[0] | (ip[1] << 8) | (ip[2] << 16) | ((uint32_t) ip[3] << 24);
+      }
+    }
+
+    pending.attempts = 0;
+    return send_iterative(pending, 0);
+  }
+
+  // Sends the iterative query to the fastest candidate server (avoiding the
+  // one that just failed, if possible).
+  bool send_iterative(PendingQuery &pending, uint32_t avoid) {
+    RecursionContext &ctx = context_of(pending);
+    ctx.server = infra_.best_server(ctx.servers, ctx.server_count, avoid, dns_millis());
+    ip_addr_set_ip4_u32(&pending.server, ctx.server);
+    pending.state = ResolveState::AWAIT_AUTHORITY;
+    return send_upstream(pending);
+  }
+
+  void handle_authority_response(PendingQuery &pending, const uint8_t *data, size_t len) {
+    RecursionContext &ctx = context_of(pending);
+    uint32_t now = dns_millis();
+
+    // Ignore anything that doesn't answer the question we asked
+    if (!dns_question_matches(pending.query, pending.query_len, data, len)) return;
+    infra_.record_rtt(ctx.server, now - (pending.deadline - upstream_timeout_), now);
+
+    uint8_t rcode = data[3] & 0x0F;
+    bool authoritative = data[2] & DNS_FLAG_AA;
+    if ((data[2] & DNS_FLAG_TC) || (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN)) {
+      // Lame or broken server - try another one
+      if (pending.attempts < RECURSION_MAX_TRIES && send_iterative(pending, ctx.server)) return;
+      fail_pending(pending);
+      return;
+    }
+
+    const uint8_t *qname = pending.query + DNS_HEADER_SIZE;
+    size_t answers = dns_skip_questions(data, len);
+    uint16_t ancount = dns_read_u16(data + 6);
+
+    if (ancount > 0) {
+      // Follow any CNAME chain inside this answer
+      uint8_t target[DNS_MAX_NAME + 1];
+      memcpy(target, qname, dns_name_length(qname));
+      bool final = false;
+      for (uint8_t hops = 0; hops <= RECURSION_MAX_CNAMES && !final; hops++) {
+        bool followed = false;
+        size_t pos = answers;
+        for (uint16_t i = 0; i < ancount && pos != 0; i++) {
+          uint8_t owner[DNS_MAX_NAME + 1];
+          size_t owner_len;
+          size_t fields = dns_read_name(data, len, pos, owner, &owner_len);
+          if (fields == 0 || fields + 10 > len) break;
+          uint16_t type = dns_read_u16(data + fields);
+          if (dns_name_equal(owner, target)) {
+            if (type == ctx.qtype) {
+              final = true;
+              break;
+            }
+            if (type == DNS_TYPE_CNAME && !followed) {
+              size_t target_len;
+              if (dns_read_name(data, len, fields + 10, target, &target_len) == 0) break;
+              followed = true;
+            }
+          }
+          pos = dns_skip_rr(data, len, pos);
+        }
+        if (!followed) break;
+      }
+
+      if (final || dns_name_equal(target, qname)) {
+        cache_.insert(data, len, now);
+        finish_recursion(pending, data, len);
+        return;
+      }
+
+      // Chain leaves this zone's data - collect it and restart at the target
+      if (++ctx.cnames > RECURSION_MAX_CNAMES || !append_chain(ctx, data, len, answers, ancount)) {
+        fail_pending(pending);
+        return;
       }
+      if (!begin_iteration(pending, target)) fail_pending(pending);
+      return;
+    }
+
+    if (rcode == DNS_RCODE_NXDOMAIN || authoritative) {
+      // Negative answer (NXDOMAIN or NODATA)
+      cache_.insert(data, len, now);
+      finish_recursion(pending, data, len);
+      return;
     }
+
+    if (!follow_referral(pending, data, len, answers)) fail_pending(pending);
   }
 
-  // ... All other methods remain unchanged ...
-  void send_nxdomain_response(uint8_t *request, size_t request_len,
-                              struct udp_pcb *pcb, const ip_addr_t *addr, u16_t port) {
-    std::vector<uint8_t> response;
-    response.reserve(512);
+  // Reads NS records from the authority section and descends to that zone.
+  bool follow_referral(PendingQuery &pending, const uint8_t *data, size_t len, size_t pos) {
+    RecursionContext &ctx = context_of(pending);
+    const uint8_t *qname = pending.query + DNS_HEADER_SIZE;
+    uint16_t nscount = dns_read_u16(data + 8);
+    uint16_t arcount = dns_read_u16(data + 10);
+    if (nscount == 0 || ++ctx.referrals > RECURSION_MAX_REFERRALS) return false;
+
+    uint8_t zone[DNS_MAX_NAME + 1];
+    zone[0] = 0;
+    size_t ns_names[INFRA_MAX_SERVERS];  // Offsets of NS targets in data
+    uint8_t ns_count = 0;
+    uint32_t ttl = CACHE_MAX_TTL;
+
+    for (uint16_t i = 0; i < nscount && pos != 0; i++) {
+      uint8_t owner[DNS_MAX_NAME + 1];
+      size_t owner_len;
+      size_t fields = dns_read_name(data, len, pos, owner, &owner_len);
+      if (fields == 0 || fields + 10 > len) return false;
+      // Only accept delegations that move closer to the name (bailiwick)
+      if (dns_read_u16(data + fields) == DNS_TYPE_NS && dns_name_in_zone(qname, owner) &&
+          dns_label_count(owner) > ctx.zone_labels && (zone[0] == 0 || dns_name_equal(owner, zone))) {
+        memcpy(zone, owner, owner_len);
+        if (ns_count < INFRA_MAX_SERVERS) ns_names[ns_count++] = fields + 10;
+        uint32_t rr_ttl = dns_read_u32(data + fields + 4);
+        if (rr_ttl < ttl) ttl = rr_ttl;
+      }
+      pos = dns_skip_rr(data, len, pos);
+    }
+    if (ns_count == 0 || pos == 0) return false;
+
+    // Glue: A records in the additional section for the NS targets
+    uint32_t servers[INFRA_MAX_SERVERS];
+    uint8_t server_count = 0;
+    for (uint16_t i = 0; i < arcount && pos != 0 && server_count < INFRA_MAX_SERVERS; i++) {
+      uint8_t owner[DNS_MAX_NAME + 1];
+      size_t owner_len;
+      size_t fields = dns_read_name(data, len, pos, owner, &owner_len);
+      if (fields == 0 || fields + 14 > len) break;
+      if (dns_read_u16(data + fields) == DNS_TYPE_A && dns_read_u16(data + fields + 8) == 4 &&
+          dns_name_in_zone(owner, zone)) {
+        for (uint8_t n = 0; n < ns_count; n++) {
+          uint8_t ns[DNS_MAX_NAME + 1];
+          size_t ns_len;
+          if (dns_read_name(data, len, ns_names[n], ns, &ns_len) != 0 && dns_name_equal(ns, owner)) {
+            memcpy(&servers[server_count++], data + fields + 10, 4);
+            break;
+          }
+        }
+      }
+      pos = dns_skip_rr(data, len, pos);
+    }
 
-    // Copy transaction ID
-    response.push_back(request[0]);
-    response.push_back(request[1]);
+    uint32_t now = dns_millis();
+    ctx.zone_labels = dns_label_count(zone);
+    if (server_count > 0) {
+      infra_.add_zone(zone, servers, server_count, ttl, now);
+      ctx.server_count = server_count;
+      memcpy(ctx.servers, servers, server_count * sizeof(uint32_t));
+      pending.attempts = 0;
+      return send_iterative(pending, 0);
+    }
 
-    // Flags: Response, Authoritative, NXDOMAIN (RCODE = 3)
-    response.push_back(0x81);
-    response.push_back(0x83);  // NXDOMAIN
+    // Glueless delegation: resolve the first NS name we can
+    uint8_t ns[DNS_MAX_NAME + 1];
+    size_t ns_len;
+    if (dns_read_name(data, len, ns_names[0], ns, &ns_len) == 0) return false;
+    const CacheEntry *cached = cache_.lookup(ns, DNS_TYPE_A, now);
+    uint32_t cached_ip = cached != nullptr ? dns_first_address(cached->data, cached->len) : 0;
+    if (cached_ip != 0) {
+      ctx.server_count = 1;
+      ctx.servers[0] = cached_ip;
+      pending.attempts = 0;
+      return send_iterative(pending, 0);
+    }
+    return start_ns_lookup(pending, ns);
+  }
 
-    // Question count (copy from request)
-    response.push_back(request[4]);
-    response.push_back(request[5]);
+  // Spawns an internal resolution for an NS host's address. The parent waits
+  // in AWAIT_NS_ADDRESS until the child resumes it.
+  bool start_ns_lookup(PendingQuery &parent, const uint8_t *ns) {
+    if (context_of(parent).parent != RECURSION_NO_PARENT) return false;  // One level deep only
+
+    PendingQuery *child = acquire_pending();
+    if (child == nullptr) return false;
+
+    child->has_client = false;
+    child->transaction_id = 0;
+    child->timestamp = dns_millis();
+    RecursionContext &ctx = context_of(*child);
+    ctx.parent = &parent - pending_queries_.data();
+    ctx.qtype = DNS_TYPE_A;
+    ctx.referrals = 0;
+    ctx.cnames = 0;
+    ctx.chain_count = 0;
+    ctx.chain_len = 0;
+
+    parent.state = ResolveState::AWAIT_NS_ADDRESS;
+    parent.deadline = dns_millis() + upstream_timeout_ * RECURSION_MAX_TRIES * 4;
+    if (!begin_iteration(*child, ns)) {
+      ctx.parent = RECURSION_NO_PARENT;
+      release_pending(*child);
+      return false;
+    }
+    return true;
+  }
 
-    // Answer, Authority, Additional = 0
-    response.push_back(0x00);
-    response.push_back(0x00);
-    response.push_back(0x00);
-    response.push_back(0x00);
-    response.push_back(0x00);
-    response.push_back(0x00);
+  void ns_address_resolved(PendingQuery &parent, uint32_t ip) {
+    if (parent.state != ResolveState::AWAIT_NS_ADDRESS) return;
+    RecursionContext &ctx = context_of(parent);
+    if (ip == 0) {
+      fail_pending(parent);
+      return;
+    }
+    ctx.server_count = 1;
+    ctx.servers[0] = ip;
+    parent.attempts = 0;
+    if (!send_iterative(parent, 0)) fail_pending(parent);
+  }
 
-    // Copy question section
-    size_t pos = 12;
-    while (pos < request_len && request[pos] != 0) {
-      response.push_back(request[pos++]);
+  // Appends this response's answer records (names expanded) to the chain.
+  bool append_chain(RecursionContext &ctx, const uint8_t *data, size_t len, size_t pos, uint16_t count) {
+    for (uint16_t i = 0; i < count; i++) {
+      size_t rr_len;
+      pos = dns_copy_rr(data, len, pos, ctx.chain + ctx.chain_len, sizeof(ctx.chain) - ctx.chain_len, &rr_len);
+      if (pos == 0) return false;
+      ctx.chain_len += rr_len;
+      ctx.chain_count++;
     }
-    if (pos < request_len) response.push_back(request[pos++]); // null terminator
+    return true;
+  }
 
-    // Copy QTYPE and QCLASS (4 bytes)
-    for (int i = 0; i < 4 && pos < request_len; i++) {
-      response.push_back(request[pos++]);
+  void finish_recursion(PendingQuery &pending, const uint8_t *data, size_t len) {
+    RecursionContext &ctx = context_of(pending);
+    int16_t parent = ctx.parent;
+    if (pending.has_client) {
+      uint8_t rcode = data[3] & 0x0F;
+      send_recursive_reply(pending, data, len, rcode);
+      query_log_.complete(pending.log_serial,
+                          rcode == DNS_RCODE_NXDOMAIN ? QueryOutcome::NXDOMAIN : QueryOutcome::RECURSIVE,
+                          elapsed_us(pending));
+      upstream_latency_.record(dns_millis() - pending.timestamp);
     }
+    uint32_t ip = parent != RECURSION_NO_PARENT ? dns_first_address(data, len) : 0;
+    release_pending(pending);
+    if (parent != RECURSION_NO_PARENT) ns_address_resolved(pending_queries_[parent], ip);
+  }
 
-    // Send NXDOMAIN response
-    struct pbuf *out = pbuf_alloc(PBUF_TRANSPORT, response.size(), PBUF_RAM);
-    if (out != nullptr) {
-      memcpy(out->payload, response.data(), response.size());
-      udp_sendto(pcb, out, addr, port);
+  // Answers the client of a recursive resolution. Without CNAME hops the
+  // authoritative response is relayed as-is; otherwise a reply is assembled
+  // from the collected chain plus the final answer records.
+  void send_recursive_reply(PendingQuery &pending, const uint8_t *data, size_t len, uint8_t rcode) {
+    RecursionContext &ctx = context_of(pending);
+    uint8_t flags = DNS_FLAG_QR | (pending.client_flags & DNS_FLAG_RD);
+
+    if (data != nullptr && ctx.chain_count == 0) {
+      struct pbuf *out = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+      if (out == nullptr) return;
+      uint8_t *reply = static_cast<uint8_t *>(out->payload);
+      memcpy(reply, data, len);
+      restore_client_id(pending, reply);
+      reply[2] = flags;
+      reply[3] = DNS_FLAG_RA | rcode;
+      transmit(udp_pcb_, out, &pending.client_addr, pending.client_port);
       pbuf_free(out);
+      return;
+    }
 
-      ESP_LOGD("dns_proxy", "Sent NXDOMAIN response");
+    // Question: the original name is the owner of the first chain record,
+    // or the current query name if nothing was followed yet
+    uint8_t *reply = scratch_;
+    const uint8_t *qname = ctx.chain_count > 0 ? ctx.chain : pending.query + DNS_HEADER_SIZE;
+    size_t qname_len = dns_name_length(qname);
+    size_t n = DNS_HEADER_SIZE;
+    memset(reply, 0, DNS_HEADER_SIZE);
+    restore_client_id(pending, reply);
+    reply[2] = flags;
+    reply[3] = DNS_FLAG_RA | rcode;
+    reply[5] = 1;
+    memcpy(reply + n, qname, qname_len);
+    n += qname_len;
+    dns_write_u16(reply + n, ctx.qtype);
+    dns_write_u16(reply + n + 2, DNS_CLASS_IN);
+    n += 4;
+
+    uint16_t ancount = 0;
+    if (rcode != DNS_RCODE_SERVFAIL) {
+      memcpy(reply + n, ctx.chain, ctx.chain_len);
+      n += ctx.chain_len;
+      ancount = ctx.chain_count;
+
+      size_t pos = data != nullptr ? dns_skip_questions(data, len) : 0;
+      for (uint16_t i = 0; pos != 0 && i < dns_read_u16(data + 6); i++) {
+        size_t rr_len;
+        pos = dns_copy_rr(data, len, pos, reply + n, sizeof(scratch_) - n, &rr_len);
+        if (pos == 0) break;
+        n += rr_len;
+        ancount++;
+      }
     }
+    dns_write_u16(reply + 6, ancount);
+
+    send_packet(udp_pcb_, reply, n, &pending.client_addr, pending.client_port);
+    if (rcode != DNS_RCODE_SERVFAIL) cache_.insert(reply, n, dns_millis());
   }
 
-  void handle_forwarded_response(struct udp_pcb *pcb, struct pbuf *p,
-                                 const ip_addr_t *addr, u16_t port) {
-    if (p->len < 12) return;
+  // One slice of background work. Each job keeps a cursor into its table and
+  // continues where the previous slice stopped, so a slice stays within the
+  // budget however large the pending pool or the cache is. The timer pass
+  // always makes progress, the cache reclaim only with budget left.
+  void run_maintenance() {
+    uint32_t start = dns_micros();
+    uint32_t now = dns_millis();
+    if (heap_changed_.exchange(false)) apply_heap_pressure();
+    if (!timer_pass_ && pending_active_ != 0 && now - last_sweep_ >= TIMER_INTERVAL_MS) {
+      timer_pass_ = true;
+      timer_cursor_ = 0;
+      last_sweep_ = now;
+    }
+    if (!reap_pass_ && cache_.enabled() && now - last_reap_ >= CACHE_REAP_INTERVAL_MS) {
+      reap_pass_ = true;
+      reap_remaining_ = cache_.capacity();
+      last_reap_ = now;
+    }
 
-    uint8_t *data = static_cast<uint8_t *>(p->payload);
-    uint16_t response_id = (data[0] << 8) | data[1];
+    while (timer_pass_) {
+      PendingQuery &pending = pending_queries_[timer_cursor_];
+      if (pending.state != ResolveState::IDLE && (int32_t) (now - pending.deadline) >= 0) {
+        resume(pending, ResolveEvent::TIMEOUT, nullptr, 0);
+      }
+      if (++timer_cursor_ == pending_queries_.size()) timer_pass_ = false;
+      if (!within_budget(start)) break;
+    }
+    dispatch_upstream();
+    while (reap_pass_ && within_budget(start)) {
+      cache_.reap(reap_cursor_, now);
+      reap_cursor_ = (reap_cursor_ + 1) % cache_.capacity();
+      if (--reap_remaining_ == 0) reap_pass_ = false;
+    }
 
-    // Find pending query
-    auto it = pending_queries_.find(response_id);
-    if (it != pending_queries_.end()) {
-      PendingQuery &pending = it->second;
+    maintenance_more_ = timer_pass_ || reap_pass_;
+    if (maintenance_more_) maintenance_deferred_++;
+  }
 
-      // Restore original transaction ID
-      data[0] = (pending.transaction_id >> 8) & 0xFF;
-      data[1] = pending.transaction_id & 0xFF;
+  // Main loop: classifies the internal heap once a second. A change is
+  // applied by the next maintenance slice on the tcpip thread.
+  void check_heap() {
+    uint32_t now = dns_millis();
+    if (now - last_heap_check_ < HEAP_CHECK_INTERVAL_MS) return;
+    last_heap_check_ = now;
+    uint32_t free = dns_free_internal_heap();
+    uint32_t largest = dns_largest_free_block();
+    if (free == 0 || !heap_guard_.update(free, largest, now)) return;
+
+    HeapPressure level = heap_guard_.level();
+    if (level == HeapPressure::NONE) {
+      ESP_LOGI("dns_proxy", "Heap recovered (%u bytes free, largest block %u) - full capacity", (unsigned) free,
+               (unsigned) largest);
+    } else {
+      ESP_LOGW("dns_proxy", "Heap pressure %s (%u bytes free, largest block %u) - shedding load",
+               heap_pressure_to_string(level), (unsigned) free, (unsigned) largest);
+    }
+    heap_pressure_ = level;
+    heap_changed_ = true;
+  }
 
-      // Forward response back to client
-      struct pbuf *response_p = pbuf_alloc(PBUF_TRANSPORT, p->len, PBUF_RAM);
-      if (response_p != nullptr) {
-        memcpy(response_p->payload, data, p->len);
-        udp_sendto(udp_pcb_, response_p, &pending.client_addr, pending.client_port);
-        pbuf_free(response_p);
+  // Admits fewer queries at once and gives the hot cache tier back while
+  // internal RAM is short. In-flight queries hold pbufs and upstream state;
+  // the rest of the cache is one block that other tasks read without a lock,
+  // so it stays.
+  void apply_heap_pressure() {
+    switch (heap_pressure_.load()) {
+      case HeapPressure::NONE:
+        pending_limit_ = max_pending_;
+        cache_.restore_hot();
+        break;
+      case HeapPressure::MODERATE:
+        pending_limit_ = max_pending_ / 2;
+        cache_.release_hot();
+        break;
+      case HeapPressure::CRITICAL:
+        pending_limit_ = max_pending_ / 4;
+        cache_.release_hot();
+        break;
+    }
+    if (pending_limit_ == 0) pending_limit_ = 1;
+  }
 
-        ESP_LOGD("dns_proxy", "Forwarded response (ID: %04x -> %04x)",
-                 response_id, pending.transaction_id);
+  PendingQuery *acquire_pending() {
+    if (pending_active_ >= pending_limit_) {
+      if (pending_limit_ < max_pending_) heap_shed_++;
+      return nullptr;
+    }
+    for (auto &pending : pending_queries_) {
+      if (pending.state == ResolveState::IDLE) {
+        pending_active_++;
+        return &pending;
       }
+    }
+    return nullptr;
+  }
+
+  void release_pending(PendingQuery &pending) {
+    if (pending.state == ResolveState::AWAIT_UPSTREAM) upstream_inflight_--;
+    pending.state = ResolveState::IDLE;
+    pending_active_--;
 
-      // Remove from pending
-      pending_queries_.erase(it);
+    // A child lookup must never resume a slot that has since been reused
+    if (contexts_ != nullptr) {
+      int16_t index = &pending - pending_queries_.data();
+      for (uint16_t i = 0; i < max_pending_; i++) {
+        if (contexts_[i].parent == index) contexts_[i].parent = RECURSION_NO_PARENT;
+      }
+    }
+  }
+
+  PendingQuery *find_pending(uint16_t upstream_id) {
+    for (auto &pending : pending_queries_) {
+      if ((pending.state == ResolveState::AWAIT_UPSTREAM || pending.state == ResolveState::AWAIT_AUTHORITY) &&
+          pending.upstream_id == upstream_id) {
+        return &pending;
+      }
     }
+    return nullptr;
   }
 
-  // ... parse_dns_name, parse_ip, get_reply_ip, build_dns_response remain unchanged ...
-  std::string parse_dns_name(uint8_t *data, size_t len) {
-    std::string name;
-    size_t pos = 0;
+  uint16_t new_upstream_id() {
+    // Avoid handing out an ID that is still in flight
+    uint16_t id;
+    do {
+      id = dns_random() & 0xFFFF;
+    } while (find_pending(id) != nullptr);
+    return id;
+  }
+
+  void restore_client_id(const PendingQuery &pending, uint8_t *data) {
+    data[0] = (pending.transaction_id >> 8) & 0xFF;
+    data[1] = pending.transaction_id & 0xFF;
+  }
+
+  void complete_to_client(PendingQuery &pending, const uint8_t *data, size_t len) {
+    struct pbuf *response_p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (response_p == nullptr) return;
+
+    uint8_t *out = static_cast<uint8_t *>(response_p->payload);
+    memcpy(out, data, len);
+    restore_client_id(pending, out);
+    transmit(udp_pcb_, response_p, &pending.client_addr, pending.client_port);
+    pbuf_free(response_p);
+
+    ESP_LOGD("dns_proxy", "Forwarded response (ID: %04x -> %04x)",
+             pending.upstream_id, pending.transaction_id);
+    query_log_.complete(pending.log_serial, QueryOutcome::FORWARDED, elapsed_us(pending));
+    upstream_latency_.record(dns_millis() - pending.timestamp);
+  }
+
+  void count_metric(Metric metric) {
+    if (!benchmark_running_) rates_.add(metric, dns_millis());
+  }
+
+  static float ratio(uint32_t part, uint32_t total) { return total > 0 ? part * 100.0f / total : 0.0f; }
+
+  uint32_t elapsed_us(const PendingQuery &pending) const { return (dns_millis() - pending.timestamp) * 1000; }
+
+  bool send_packet(struct udp_pcb *pcb, const uint8_t *data, size_t len,
+                   const ip_addr_t *addr, u16_t port) {
+    struct pbuf *out = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (out == nullptr) return false;
+
+    pbuf_take(out, data, len);
+    err_t err = transmit(pcb, out, addr, port);
+    pbuf_free(out);
+    return err == ERR_OK;
+  }
 
-    while (pos < len && data[pos] != 0) {
-      uint8_t label_len = data[pos++];
-      if (label_len > 63 || pos + label_len > len) break;
+  // All replies to clients go out through here. During a self-benchmark
+  // nothing reaches the radio.
+  err_t transmit(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    if (benchmark_running_) return ERR_OK;
+#ifdef USE_DNS_PROXY_CAPTURE
+    capture_packet(p, addr, port, pcb->local_port, true);
+#endif
+    return udp_sendto(pcb, p, addr, port);
+  }
 
-      if (!name.empty()) name += ".";
-      name.append(reinterpret_cast<char*>(data + pos), label_len);
-      pos += label_len;
+#ifdef USE_DNS_PROXY_CAPTURE
+  // --- Packet capture -------------------------------------------------------
+
+  // Clears the capture buffer and records every packet the proxy receives or
+  // sends until stop_capture() or the buffer is full.
+  void start_capture() {
+    if (!capture_.enabled() || udp_pcb_ == nullptr) return;
+    tcpip_callback([](void *arg) {
+      auto *self = static_cast<DnsRedirect *>(arg);
+      if (!self->capture_.start(dns_micros())) {
+        ESP_LOGW("dns_proxy", "Capture download in progress - not starting a new capture");
+        return;
+      }
+      ESP_LOGI("dns_proxy", "Packet capture started (%u bytes)", (unsigned) self->capture_.capacity());
+    }, this);
+  }
+  void stop_capture() {
+    capture_.stop();
+    ESP_LOGI("dns_proxy", "Packet capture stopped after %u packets", (unsigned) capture_.packet_count());
+  }
+  const PacketCapture &get_capture() const { return capture_; }
+
+  void capture_packet(const struct pbuf *p, const ip_addr_t *peer, u16_t peer_port, u16_t local_port,
+                      bool outgoing) {
+    if (capture_.state() != CaptureState::RUNNING || !IP_IS_V4(peer)) return;
+    // Our own address is only known while lwIP is delivering a packet
+    if (!outgoing && ip_current_dest_addr() != nullptr && IP_IS_V4(ip_current_dest_addr())) {
+      capture_local_ip_ = ip4_addr_get_u32(ip_2_ip4(ip_current_dest_addr()));
     }
+    uint32_t peer_ip = ip4_addr_get_u32(ip_2_ip4(peer));
+    const auto *payload = static_cast<const uint8_t *>(p->payload);
+    bool added = outgoing ? capture_.add(payload, p->len, p->tot_len, capture_local_ip_, local_port, peer_ip,
+                                         peer_port, dns_micros())
+                          : capture_.add(payload, p->len, p->tot_len, peer_ip, peer_port, capture_local_ip_,
+                                         local_port, dns_micros());
+    if (!added) ESP_LOGI("dns_proxy", "Capture buffer full - stopped after %u packets",
+                         (unsigned) capture_.packet_count());
+  }
+#endif
 
-    return name;
+  // --- Self-benchmark -------------------------------------------------------
+
+  void set_benchmark_qps_sensor(sensor::Sensor *sensor) { benchmark_qps_sensor_ = sensor; }
+  void set_benchmark_cycles_sensor(sensor::Sensor *sensor) { benchmark_cycles_sensor_ = sensor; }
+  void set_benchmark_heap_sensor(sensor::Sensor *sensor) { benchmark_heap_sensor_ = sensor; }
+
+  // Feeds synthetic queries (local hit, wildcard hit, miss) straight into
+  // handle_dns_request() on the tcpip thread. Results are published from loop().
+  void run_benchmark(uint32_t iterations) {
+    if (udp_pcb_ == nullptr) {
+      ESP_LOGW("dns_proxy", "Benchmark not started: DNS server is not running");
+      return;
+    }
+    if (benchmark_busy_.exchange(true)) {
+      ESP_LOGW("dns_proxy", "Benchmark already running");
+      return;
+    }
+    benchmark_iterations_ = iterations;
+    if (tcpip_callback([](void *arg) { static_cast<DnsRedirect *>(arg)->benchmark_on_tcpip(); }, this) != ERR_OK) {
+      benchmark_busy_ = false;
+    }
   }
 
-  uint32_t parse_ip(const std::string &ip_str) {
-    uint32_t ip = 0;
-    int parts[4] = {0};
-    sscanf(ip_str.c_str(), "%d.%d.%d.%d", &parts[0], &parts[1], &parts[2], &parts[3]);
-    ip = parts[0] | (parts[1] << 8) | (parts[2] << 16) | (parts[3] << 24);
-    return ip;
+  void benchmark_on_tcpip() {
+    // One prepared query per kind; kinds without a matching record are skipped
+    static const uint8_t BENCH_LABEL[] = {5, 'b', 'e', 'n', 'c', 'h'};
+    uint8_t names[3][DNS_MAX_NAME + 1];
+    bool have[3] = {false, false, false};
+    for (const auto &record : local_records_) {
+      const uint8_t *name = names_.name(record.name);
+      size_t len = dns_name_length(name);
+      if (record.wildcard && !have[1] && len + sizeof(BENCH_LABEL) <= DNS_MAX_NAME) {
+        memcpy(names[1], BENCH_LABEL, sizeof(BENCH_LABEL));
+        memcpy(names[1] + sizeof(BENCH_LABEL), name, len);
+        have[1] = true;
+      } else if (!record.wildcard && !have[0]) {
+        memcpy(names[0], name, len);
+        have[0] = true;
+      }
+    }
+    have[2] = dns_encode_name("bench-miss.invalid", 18, names[2]) > 0;
+
+    for (int kind = 0; kind < 3; kind++) {
+      benchmark_pbufs_[kind] = have[kind] ? build_query_pbuf(names[kind]) : nullptr;
+    }
+
+    benchmark_next_ = 0;
+    benchmark_done_count_ = 0;
+    benchmark_cycle_sum_ = 0;
+    benchmark_elapsed_us_ = 0;
+    benchmark_heap_sum_ = 0;
+    benchmark_slice();
   }
 
-  uint32_t get_reply_ip(const std::string &query) {
-    // Exact match
-    auto it = records_.find(query);
-    if (it != records_.end()) {
-      return it->second;
+  // Runs the next BENCHMARK_SLICE queries and reschedules itself, so lwIP
+  // (and WiFi with it) keeps serving real traffic in between. Every counter
+  // a benchmark query can touch is put back after each slice.
+  void benchmark_slice() {
+    ip_addr_t client;
+    ip_addr_set_ip4_u32(&client, 0);
+    BenchmarkCounters saved = save_benchmark_counters();
+    benchmark_running_ = true;
+
+    uint32_t total = benchmark_iterations_ * 3;
+    uint32_t end = total - benchmark_next_ > BENCHMARK_SLICE ? benchmark_next_ + BENCHMARK_SLICE : total;
+    uint32_t heap_before = get_free_heap();
+    uint32_t start_us = dns_micros();
+    for (; benchmark_next_ < end; benchmark_next_++) {
+      struct pbuf *query = benchmark_pbufs_[benchmark_next_ % 3];
+      if (query == nullptr) continue;
+      uint32_t begin = arch_get_cpu_cycle_count();
+      handle_dns_request(udp_pcb_, query, &client, 0);
+      benchmark_cycle_sum_ += arch_get_cpu_cycle_count() - begin;
+      benchmark_done_count_++;
     }
+    benchmark_elapsed_us_ += dns_micros() - start_us;
+    benchmark_heap_sum_ += (int32_t) get_free_heap() - (int32_t) heap_before;
 
-    // Wildcard match (*.domain.com matches sub.domain.com)
-    for (const auto &record : records_) {
-      if (record.first[0] == '*' && record.first[1] == '.') {
-        std::string pattern = record.first.substr(2);
-        if (query.size() > pattern.size() &&
-            query.substr(query.size() - pattern.size()) == pattern) {
-          return record.second;
-        }
+    benchmark_running_ = false;
+    restore_benchmark_counters(saved);
+
+    if (benchmark_next_ < total) {
+      if (tcpip_callback([](void *arg) { static_cast<DnsRedirect *>(arg)->benchmark_slice(); }, this) == ERR_OK) {
+        return;
       }
+      ESP_LOGW("dns_proxy", "Benchmark cut short: next slice could not be scheduled");
     }
 
-    // No match - return 0 to indicate forwarding needed
-    return 0;
+    for (auto *&query : benchmark_pbufs_) {
+      if (query != nullptr) pbuf_free(query);
+      query = nullptr;
+    }
+    uint32_t done = benchmark_done_count_;
+    benchmark_queries_ = done;
+    benchmark_qps_ = benchmark_elapsed_us_ > 0 ? done * 1000000.0f / benchmark_elapsed_us_ : 0;
+    benchmark_cycles_ = done > 0 ? benchmark_cycle_sum_ / done : 0;
+    benchmark_heap_delta_ = benchmark_heap_sum_;
+    benchmark_done_ = true;
+    benchmark_busy_ = false;
   }
 
-  void build_dns_response(uint8_t *request, size_t request_len,
-                          uint32_t reply_ip, std::vector<uint8_t> &response) {
-    response.reserve(512);
+  struct BenchmarkCounters {
+    uint32_t queries;
+    uint32_t fast_path;
+    uint32_t dropped;
+    uint32_t heap_shed;
+    DnsCache::Counters cache;
+    ProbeStats names;
+    ProbeStats fast_path_probes;
+  };
+
+  BenchmarkCounters save_benchmark_counters() const {
+    return BenchmarkCounters{query_count_, fast_path_count_, dropped_count_, heap_shed_,
+                             cache_.save_counters(), names_.get_probe_stats(), local_answers_.get_probe_stats()};
+  }
 
-    // Copy transaction ID
-    response.push_back(request[0]);
-    response.push_back(request[1]);
+  void restore_benchmark_counters(const BenchmarkCounters &saved) {
+    query_count_ = saved.queries;
+    fast_path_count_ = saved.fast_path;
+    dropped_count_ = saved.dropped;
+    heap_shed_ = saved.heap_shed;
+    cache_.restore_counters(saved.cache);
+    names_.restore_probe_stats(saved.names);
+    local_answers_.restore_probe_stats(saved.fast_path_probes);
+  }
 
-    // Flags: Response, Authoritative, No error
-    response.push_back(0x81);
-    response.push_back(0x80);
+  void publish_benchmark() {
+    ESP_LOGI("dns_proxy", "Benchmark: %u queries, %.0f QPS, %u cycles/query, heap delta %d bytes",
+             (unsigned) benchmark_queries_, benchmark_qps_, (unsigned) benchmark_cycles_, (int) benchmark_heap_delta_);
+    if (benchmark_qps_sensor_ != nullptr) benchmark_qps_sensor_->publish_state(benchmark_qps_);
+    if (benchmark_cycles_sensor_ != nullptr) benchmark_cycles_sensor_->publish_state(benchmark_cycles_);
+    if (benchmark_heap_sensor_ != nullptr) benchmark_heap_sensor_->publish_state(benchmark_heap_delta_);
+  }
 
-    // Question count (copy from request)
-    response.push_back(request[4]);
-    response.push_back(request[5]);
+  struct pbuf *build_query_pbuf(const uint8_t *name) {
+    uint8_t query[DNS_HEADER_SIZE + DNS_MAX_NAME + 5] = {0x12, 0x34, DNS_FLAG_RD, 0, 0, 1};
+    size_t name_len = dns_name_length(name);
+    memcpy(query + DNS_HEADER_SIZE, name, name_len);
+    size_t n = DNS_HEADER_SIZE + name_len;
+    dns_write_u16(query + n, DNS_TYPE_A);
+    dns_write_u16(query + n + 2, DNS_CLASS_IN);
+    n += 4;
+
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, n, PBUF_RAM);
+    if (p != nullptr) pbuf_take(p, query, n);
+    return p;
+  }
 
-    // Answer count = 1
-    response.push_back(0x00);
-    response.push_back(0x01);
+  // --- Cache invalidation ---------------------------------------------------
 
-    // Authority and Additional = 0
-    response.push_back(0x00);
-    response.push_back(0x00);
-    response.push_back(0x00);
-    response.push_back(0x00);
+  // Drop cached answers: everything, every type of one name, or a name with
+  // everything below it. The work is done on the tcpip thread.
+  enum class CacheFlush : uint8_t { ALL, NAME, SUFFIX };
 
-    // Copy question section
-    size_t pos = 12;
-    while (pos < request_len && request[pos] != 0) {
-      response.push_back(request[pos++]);
+  void flush_cache() { schedule_flush(CacheFlush::ALL, ""); }
+  void flush_cache_name(const std::string &name) { schedule_flush(CacheFlush::NAME, name); }
+  void flush_cache_suffix(const std::string &suffix) { schedule_flush(CacheFlush::SUFFIX, suffix); }
+
+  struct FlushRequest {
+    DnsRedirect *parent;
+    CacheFlush kind;
+    uint8_t name[DNS_MAX_NAME + 1];
+  };
+
+  void schedule_flush(CacheFlush kind, const std::string &name) {
+    if (!cache_.enabled()) {
+      ESP_LOGW("dns_proxy", "Cache flush ignored: caching is disabled");
+      return;
+    }
+    auto *request = new FlushRequest{this, kind, {}};
+    if (kind != CacheFlush::ALL) {
+      size_t start = name.compare(0, 2, "*.") == 0 ? 2 : (name.compare(0, 1, ".") == 0 ? 1 : 0);
+      if (dns_encode_name(name.data() + start, name.size() - start, request->name) <= 1) {
+        ESP_LOGW("dns_proxy", "Cache flush ignored: invalid name '%s'", name.c_str());
+        delete request;
+        return;
+      }
     }
-    if (pos < request_len) response.push_back(request[pos++]); // null terminator
+    if (tcpip_callback([](void *arg) {
+          auto *request = static_cast<FlushRequest *>(arg);
+          request->parent->flush_on_tcpip(*request);
+          delete request;
+        }, request) != ERR_OK) {
+      ESP_LOGW("dns_proxy", "Cache flush could not be scheduled");
+      delete request;
+    }
+  }
+
+  void flush_on_tcpip(const FlushRequest &request) {
+    uint16_t removed = request.kind == CacheFlush::ALL
+                           ? cache_.flush()
+                           : cache_.flush_matching(request.name, request.kind == CacheFlush::SUFFIX);
+    ESP_LOGI("dns_proxy", "Flushed %u cache entries", removed);
+  }
+
+  // Writes the header and question of a reply to request into scratch_, with
+  // ancount answers to follow. A question that doesn't parse is left out.
+  // Returns the length so far.
+  size_t begin_reply(const uint8_t *request, size_t request_len, uint8_t rcode, uint16_t ancount) {
+    size_t name_end;
+    uint16_t qtype;
+    size_t n = dns_parse_question(request, request_len, &name_end, &qtype) ? name_end + 4 : DNS_HEADER_SIZE;
+    memcpy(scratch_, request, 2);  // Transaction ID
+    scratch_[2] = DNS_FLAG_QR | DNS_FLAG_RD;
+    scratch_[3] = DNS_FLAG_RA | rcode;
+    dns_write_u16(scratch_ + 4, n > DNS_HEADER_SIZE ? 1 : 0);
+    dns_write_u16(scratch_ + 6, ancount);
+    dns_write_u16(scratch_ + 8, 0);
+    dns_write_u16(scratch_ + 10, 0);
+    memcpy(scratch_ + DNS_HEADER_SIZE, request + DNS_HEADER_SIZE, n - DNS_HEADER_SIZE);
+    return n;
+  }
 
-    // Copy QTYPE and QCLASS (4 bytes)
-    for (int i = 0; i < 4 && pos < request_len; i++) {
-      response.push_back(request[pos++]);
+  // request must not be scratch_.
+  void send_error_response(const uint8_t *request, size_t request_len, struct udp_pcb *pcb,
+                           const ip_addr_t *addr, u16_t port, uint8_t rcode) {
+    size_t n = begin_reply(request, request_len, rcode, 0);
+    if (send_packet(pcb, scratch_, n, addr, port)) {
+      ESP_LOGD("dns_proxy", "Sent error response (RCODE %d)", rcode);
     }
+  }
+
+  void handle_forwarded_response(struct udp_pcb *pcb, struct pbuf *p,
+                                 const ip_addr_t *addr, u16_t port) {
+    if (p->len < 12) return;
+
+    uint8_t *data = static_cast<uint8_t *>(p->payload);
+    uint16_t response_id = (data[0] << 8) | data[1];
 
-    // Answer section
-    // Name pointer to question
-    response.push_back(0xc0);
-    response.push_back(0x0c);
+    // Only accept answers from the server we asked
+    PendingQuery *pending = find_pending(response_id);
+    if (pending != nullptr && port == 53 && ip_addr_cmp(addr, &pending->server)) {
+      resume(*pending, ResolveEvent::RESPONSE, data, p->len);
+      dispatch_upstream();
+    }
+  }
 
-    // Type A (IPv4)
-    response.push_back(0x00);
-    response.push_back(0x01);
+  uint32_t parse_ip(const std::string &ip_str) {
+    uint32_t ip = 0;
+    int parts[4] = {0};
+    sscanf(ip_str.c_str(), "%d.%d.%d.%d", &parts[0], &parts[1], &parts[2], &parts[3]);
+    ip = parts[0] | (parts[1] << 8) | (parts[2] << 16) | (parts[3] << 24);
+    return ip;
+  }
 
-    // Class IN
-    response.push_back(0x00);
-    response.push_back(0x01);
+  // Exact record for the uncompressed wire name, else the wildcard record of
+  // the closest enclosing name (*.domain.com matches sub.domain.com). Returns
+  // 0 to indicate forwarding needed.
+  uint32_t get_reply_ip(const uint8_t *name) {
+    uint16_t rule = find_rule(name);
+    return rule != RULE_NONE ? local_records_[rule].ip : 0;
+  }
 
-    // TTL (60 seconds)
-    response.push_back(0x00);
-    response.push_back(0x00);
-    response.push_back(0x00);
-    response.push_back(0x3c);
+  // Index of the record get_reply_ip() would use, or RULE_NONE. One arena
+  // lookup per label: the name's tag leads straight to its rules.
+  uint16_t find_rule(const uint8_t *name) {
+    for (size_t pos = 0; name[pos] != 0; pos += name[pos] + 1) {
+      NameHandle handle = names_.find(name + pos);
+      uint16_t slot = handle != NAME_NONE ? names_.tag(handle) : NAME_TAG_NONE;
+      if (slot == NAME_TAG_NONE) continue;
+      uint16_t rule = pos == 0 ? rule_slots_[slot].exact : rule_slots_[slot].wildcard;
+      if (rule != RULE_NONE) return rule;
+    }
+    return RULE_NONE;
+  }
 
-    // Data length (4 bytes for IPv4)
-    response.push_back(0x00);
-    response.push_back(0x04);
+  void count_rule_hit(uint16_t rule) {
+    if (benchmark_running_) return;
+    RuleStats &stats = rule_stats_[rule];
+    stats.hits++;
+    stats.last_hit_ms = dns_millis();
+  }
 
-    // IP address (little endian)
-    response.push_back((reply_ip >> 0) & 0xFF);
-    response.push_back((reply_ip >> 8) & 0xFF);
-    response.push_back((reply_ip >> 16) & 0xFF);
-    response.push_back((reply_ip >> 24) & 0xFF);
+  // Reply with one A record (TTL 60) for a query that has a valid question,
+  // in scratch_. Returns its length.
+  size_t build_dns_response(const uint8_t *request, size_t request_len, uint32_t reply_ip) {
+    size_t n = begin_reply(request, request_len, DNS_RCODE_NOERROR, 1);
+    uint8_t *rr = scratch_ + n;
+    dns_write_u16(rr, 0xC000 | DNS_HEADER_SIZE);  // Name: pointer to the question
+    dns_write_u16(rr + 2, DNS_TYPE_A);
+    dns_write_u16(rr + 4, DNS_CLASS_IN);
+    dns_write_u32(rr + 6, 60);
+    dns_write_u16(rr + 10, 4);
+    memcpy(rr + 12, &reply_ip, 4);  // Already in network order
+    return n + 16;
   }
 
  private:
   struct udp_pcb *udp_pcb_{nullptr};      // Server PCB (port 53)
   struct udp_pcb *client_pcb_{nullptr};   // Client PCB (for forwarding)
-  std::map<std::string, uint32_t> records_;
-  std::map<uint16_t, PendingQuery> pending_queries_;
+  std::map<std::string, uint32_t> records_;  // As configured; emptied once interned
+  std::vector<LocalRecord> local_records_;
+  std::vector<RuleSlot> rule_slots_;
+  LocalAnswerTable local_answers_;
+  NameArena names_;
+  std::vector<PendingQuery> pending_queries_;
+  std::atomic<uint32_t> pending_active_{0};
+  std::atomic<bool> sweep_scheduled_{false};
+  std::atomic<bool> maintenance_more_{false};
+  uint32_t maintenance_budget_us_{2000};
+  HeapGuard heap_guard_;  // Main loop only
+  uint32_t last_heap_check_{0};
+  std::atomic<HeapPressure> heap_pressure_{HeapPressure::NONE};
+  std::atomic<bool> heap_changed_{false};
+  uint16_t pending_limit_{16};  // Written on the tcpip thread
+  uint32_t heap_shed_{0};
+  uint32_t maintenance_deferred_{0};
+  uint32_t last_sweep_{0};  // Maintenance state below is written on the tcpip thread
+  bool timer_pass_{false};
+  uint16_t timer_cursor_{0};
+  uint32_t last_reap_{0};
+  bool reap_pass_{false};
+  uint16_t reap_cursor_{0};
+  uint16_t reap_remaining_{0};
+  uint16_t max_pending_{16};
+  uint16_t max_upstream_{8};
+  FairQueue fair_queue_;
+  uint32_t upstream_inflight_{0};  // Forwards in AWAIT_UPSTREAM
+  uint32_t upstream_queued_{0};
+  LatencyHistogram queue_delay_[static_cast<uint8_t>(QueueClass::COUNT)];
+  uint32_t upstream_timeout_{2000};
+  uint8_t upstream_retries_{1};
   ip_addr_t upstream_dns_;
   bool has_upstream_dns_{false};
+  bool recursive_{false};
+  uint16_t cache_size_{64};
+  uint8_t hot_cache_size_{8};
+  DnsCache cache_;
+  InfraCache infra_;
+  RecursionContext *contexts_{nullptr};
+  uint8_t scratch_[CACHE_MAX_RESPONSE];  // Reply assembly, tcpip thread only
+
+  bool adaptive_ps_{false};
+  bool ps_suspended_{false};
+  PowerSaveMode ps_saved_mode_{POWER_SAVE_DEFAULT};
+  uint32_t ps_active_queries_{1};
+  uint32_t ps_quiet_period_{30000};
+  uint32_t ps_window_start_{0};
+  uint32_t ps_window_count_{0};
+  uint32_t ps_last_active_{0};
+  uint32_t ps_transitions_{0};
+
+#ifdef USE_DNS_PROXY_CAPTURE
+  uint32_t capture_size_{0};
+  PacketCapture capture_;
+  uint32_t capture_local_ip_{0};
+#endif
+#ifdef USE_DNS_PROXY_MDNS
+  bool mdns_bridge_enabled_{false};
+  MdnsBridge mdns_;
+  std::atomic<bool> mdns_scheduled_{false};
+#endif
+
+  bool benchmark_running_{false};  // tcpip thread only
+  std::atomic<bool> benchmark_busy_{false};
+  std::atomic<bool> benchmark_done_{false};
+  uint32_t benchmark_iterations_{0};
+  struct pbuf *benchmark_pbufs_[3]{};  // State of the run in progress, tcpip thread only
+  uint32_t benchmark_next_{0};
+  uint32_t benchmark_done_count_{0};
+  uint64_t benchmark_cycle_sum_{0};
+  uint32_t benchmark_elapsed_us_{0};
+  int32_t benchmark_heap_sum_{0};
+  uint32_t benchmark_queries_{0};
+  float benchmark_qps_{0};
+  uint32_t benchmark_cycles_{0};
+  int32_t benchmark_heap_delta_{0};
+  sensor::Sensor *benchmark_qps_sensor_{nullptr};
+  sensor::Sensor *benchmark_cycles_sensor_{nullptr};
+  sensor::Sensor *benchmark_heap_sensor_{nullptr};
 
   uint32_t query_count_{0};
+  uint32_t fast_path_count_{0};
   uint32_t forwarded_count_{0};
-  std::string last_query_;
+  uint32_t prefetch_count_{0};
+  bool prefetch_siblings_{false};
+  uint32_t timeout_count_{0};
+  RateWindow rates_;
+  LatencyHistogram upstream_latency_;
+  uint32_t dropped_count_{0};
+  uint8_t query_log_size_{16};
+  QueryLog query_log_;
+  uint32_t current_log_{QUERY_LOG_NONE};  // Entry of the query being handled
+  text_sensor::TextSensor *last_query_text_sensor_{nullptr};
+  uint32_t last_query_published_{QUERY_LOG_NONE};
+  uint32_t last_query_published_ms_{0};
+  std::vector<RuleStats> rule_stats_;
+  uint8_t rule_report_top_{10};
+  std::vector<StatSensor> stat_sensors_;
+  LatencyWindow latency_window_;
+  uint32_t last_stat_check_{0};
+  size_t stat_cursor_{0};
 };
 
 }  // namespace dns_proxy
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace dns_proxy {
+
+// Clients with their own queue; further clients share the last one.
+static const uint8_t FAIR_QUEUE_CLIENTS = 8;
+// Bytes of query credited to a client queue per round: about one typical
+// query, so clients take turns. Longer (EDNS-padded) queries save up credit
+// over a few rounds.
+static const uint16_t FAIR_QUEUE_QUANTUM = 64;
+static const uint16_t QUEUE_NONE = 0xFFFF;
+
+// Deficit round robin over per-client FIFOs of pending-pool slots. Queries
+// cost their length, so a client flooding the proxy gets its share of the
+// upstream capacity and no more, and a quiet client's query waits for at
+// most one round. Storage is sized once for the pool; only the tcpip thread
+// touches it.
+class FairQueue {
+ public:
+  void init(uint16_t slots) {
+    next_.assign(slots, QUEUE_NONE);
+    cost_.assign(slots, 0);
+    owner_.assign(slots, 0);
+  }
+
+  bool empty() const { return queued_ == 0; }
+  uint16_t size() const { return queued_; }
+
+  // Appends a pool slot to the client's queue. Returns how many of that
+  // client's queries were already waiting.
+  uint16_t push(uint32_t client, uint16_t slot, uint16_t cost) {
+    uint8_t index = queue_for(client);
+    ClientQueue &queue = queues_[index];
+    next_[slot] = QUEUE_NONE;
+    cost_[slot] = cost;
+    owner_[slot] = index;
+    if (queue.tail == QUEUE_NONE) {
+      queue.head = slot;
+    } else {
+      next_[queue.tail] = slot;
+    }
+    queue.tail = slot;
+    queued_++;
+    return queue.length++;
+  }
+
+  // Next slot to send in DRR order, QUEUE_NONE if nothing is waiting.
+  uint16_t pop() {
+    if (queued_ == 0) return QUEUE_NONE;
+    while (true) {
+      ClientQueue &queue = queues_[current_];
+      if (queue.length > 0) {
+        if (!credited_) {
+          queue.deficit += FAIR_QUEUE_QUANTUM;
+          credited_ = true;
+        }
+        uint16_t slot = queue.head;
+        if (cost_[slot] <= queue.deficit) {
+          queue.deficit -= cost_[slot];
+          unlink(current_, slot);
+          if (queue.length == 0) advance();
+          return slot;
+        }
+      }
+      advance();
+    }
+  }
+
+  // Takes a slot out of its queue wherever it is (it timed out waiting).
+  void remove(uint16_t slot) { unlink(owner_[slot], slot); }
+
+ protected:
+  struct ClientQueue {
+    uint32_t client{0};  // IPv4, network order
+    uint16_t head{QUEUE_NONE};
+    uint16_t tail{QUEUE_NONE};
+    uint16_t length{0};
+    uint16_t deficit{0};
+  };
+
+  // The client's queue, else an idle one taken over, else the shared last
+  // one. A queue keeps its client while anything is waiting in it.
+  uint8_t queue_for(uint32_t client) {
+    uint8_t idle = FAIR_QUEUE_CLIENTS;
+    for (uint8_t i = 0; i < FAIR_QUEUE_CLIENTS; i++) {
+      if (queues_[i].length > 0 && queues_[i].client == client) return i;
+      if (queues_[i].length == 0 && idle == FAIR_QUEUE_CLIENTS) idle = i;
+    }
+    if (idle == FAIR_QUEUE_CLIENTS) return FAIR_QUEUE_CLIENTS - 1;
+    queues_[idle].client = client;
+    return idle;
+  }
+
+  void unlink(uint8_t index, uint16_t slot) {
+    ClientQueue &queue = queues_[index];
+    uint16_t prev = QUEUE_NONE;
+    for (uint16_t at = queue.head; at != slot; at = next_[at]) {
+      if (at == QUEUE_NONE) return;  // Not queued
+      prev = at;
+    }
+    if (prev == QUEUE_NONE) {
+      queue.head = next_[slot];
+    } else {
+      next_[prev] = next_[slot];
+    }
+    if (queue.tail == slot) queue.tail = prev;
+    if (--queue.length == 0) queue.deficit = 0;  // Idle queues don't save up credit
+    queued_--;
+  }
+
+  void advance() {
+    current_ = (current_ + 1) % FAIR_QUEUE_CLIENTS;
+    credited_ = false;
+  }
+
+  ClientQueue queues_[FAIR_QUEUE_CLIENTS];
+  std::vector<uint16_t> next_;
+  std::vector<uint16_t> cost_;
+  std::vector<uint8_t> owner_;
+  uint16_t queued_{0};
+  uint8_t current_{0};
+  bool credited_{false};
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
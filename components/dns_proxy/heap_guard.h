@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+
+namespace esphome {
+namespace dns_proxy {
+
+enum class HeapPressure : uint8_t {
+  NONE,
+  MODERATE,  // Fewer queries in flight, no prefetch, hot cache tier released
+  CRITICAL,  // A quarter of the pending pool only
+};
+
+// Largest free block below which lwIP may fail to allocate an answer pbuf
+// with its headers; below twice this the heap counts as fragmented.
+static const uint32_t HEAP_MIN_BLOCK = 2048;
+// How long the heap has to stay clear of a level's exit threshold before the
+// pressure goes down a level.
+static const uint32_t HEAP_RECOVER_MS = 10000;
+static const uint32_t HEAP_CHECK_INTERVAL_MS = 1000;
+
+// Classifies the internal heap against the configured floor. Pressure rises
+// as soon as free memory or the largest block falls below a threshold, but
+// only falls a level at a time, once the heap has stayed a quarter above the
+// threshold (plus whatever the proxy will allocate again) for HEAP_RECOVER_MS.
+class HeapGuard {
+ public:
+  void set_min_free(uint32_t bytes) { min_free_ = bytes; }
+  // Memory given back under pressure and allocated again once it ends
+  void set_reclaim(uint32_t bytes) { reclaim_ = bytes; }
+  bool enabled() const { return min_free_ > 0; }
+  HeapPressure level() const { return level_; }
+
+  // Returns true if the level changed.
+  bool update(uint32_t free, uint32_t largest, uint32_t now) {
+    HeapPressure worse = classify(free, largest, false);
+    if (worse > level_) {
+      level_ = worse;
+      calm_since_ = now;
+      return true;
+    }
+    if (classify(free, largest, true) >= level_) {
+      calm_since_ = now;
+      return false;
+    }
+    if (now - calm_since_ < HEAP_RECOVER_MS) return false;
+    level_ = static_cast<HeapPressure>(static_cast<uint8_t>(level_) - 1);
+    calm_since_ = now;
+    return true;
+  }
+
+ protected:
+  HeapPressure classify(uint32_t free, uint32_t largest, bool recovering) const {
+    uint32_t floor = min_free_;
+    uint32_t block = HEAP_MIN_BLOCK;
+    if (recovering) {
+      floor += floor / 4 + reclaim_;
+      block += block / 4;
+    }
+    if (free < floor / 2 || largest < block) return HeapPressure::CRITICAL;
+    if (free < floor || largest < block * 2) return HeapPressure::MODERATE;
+    return HeapPressure::NONE;
+  }
+
+  uint32_t min_free_{0};
+  uint32_t reclaim_{0};
+  HeapPressure level_{HeapPressure::NONE};
+  uint32_t calm_since_{0};
+};
+
+inline const char *heap_pressure_to_string(HeapPressure level) {
+  switch (level) {
+    case HeapPressure::MODERATE:
+      return "moderate";
+    case HeapPressure::CRITICAL:
+      return "critical";
+    default:
+      return "none";
+  }
+}
+
+}  // namespace dns_proxy
+}  // namespace esphome
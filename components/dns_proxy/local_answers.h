@@ -0,0 +1,129 @@
+#pragma once
+
+#include "dns_message.h"
+#include "name_arena.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace esphome {
+namespace dns_proxy {
+
+static const uint32_t LOCAL_ANSWER_TTL = 60;
+static const size_t LOCAL_ANSWER_RR_SIZE = 16;
+
+// Prebuilt wire-format answers for the exact (non-wildcard) local records,
+// in an open-addressed table keyed by name hash. answer() validates a query
+// and writes the complete reply in one pass over the packet, so the common
+// "rewrite this hostname" case never reaches the general request path.
+// Built once during setup; afterwards only read on the tcpip thread.
+class LocalAnswerTable {
+ public:
+  // name must stay valid for the table's lifetime (an interned record name);
+  // rule is reported back by answer() for hit counting. Records without an
+  // address (ip 0) are left to the general path, which forwards them.
+  void add(const uint8_t *name, uint32_t ip, uint16_t rule) {
+    if (ip == 0) return;
+    pending_.push_back(Slot{dns_hash_wire(name), name, rule, {}});
+    fill_rr(pending_.back(), ip);
+  }
+
+  // Lays out the table; call once after all add() calls.
+  void build() {
+    size_t size = 1;
+    while (size < pending_.size() * 2) size <<= 1;
+    slots_.assign(pending_.empty() ? 0 : size, Slot{0, nullptr, 0, {}});
+    for (const auto &slot : pending_) {
+      size_t i = slot.hash & (slots_.size() - 1);
+      while (slots_[i].name != nullptr && !dns_name_equal(slots_[i].name, slot.name)) i = (i + 1) & (slots_.size() - 1);
+      if (slots_[i].name == nullptr) slots_[i] = slot;
+    }
+    std::vector<Slot>().swap(pending_);
+  }
+
+  bool empty() const { return slots_.empty(); }
+  const ProbeStats &get_probe_stats() const { return probe_stats_; }
+  void restore_probe_stats(const ProbeStats &saved) { probe_stats_ = saved; }
+
+  // Writes the reply for a standard A/IN query that exactly matches a record
+  // into out (at least len + LOCAL_ANSWER_RR_SIZE bytes) and sets *rule to
+  // the record's. Returns its length, or 0 if the query must take the normal
+  // path.
+  size_t answer(const uint8_t *query, size_t len, uint8_t *out, uint16_t *rule) const {
+    if (slots_.empty() || len < DNS_HEADER_SIZE + 5) return 0;
+    // Plain query (QR=0, OPCODE=0), one question, nothing else but EDNS
+    if ((query[2] & 0xF8) != 0 || dns_read_u16(query + 4) != 1 || dns_read_u16(query + 6) != 0 ||
+        dns_read_u16(query + 8) != 0 || dns_read_u16(query + 10) > 1) {
+      return 0;
+    }
+
+    // Walk and hash the (uncompressed) name in one pass
+    NameHasher hasher;
+    size_t pos = DNS_HEADER_SIZE;
+    while (true) {
+      if (pos >= len) return 0;
+      uint8_t label = query[pos];
+      if (label > 63 || pos + label + 1 > len) return 0;
+      for (size_t i = 0; i <= label; i++) hasher.add(dns_lower(query[pos + i]));
+      pos += label + 1;
+      if (label == 0) break;
+    }
+    if (pos + 4 > len || dns_read_u16(query + pos) != DNS_TYPE_A || dns_read_u16(query + pos + 2) != DNS_CLASS_IN) {
+      return 0;
+    }
+
+    const Slot *slot = find(query + DNS_HEADER_SIZE, hasher.finish());
+    if (slot == nullptr) return 0;
+
+    size_t n = pos + 4;
+    memcpy(out, query, n);
+    out[2] = DNS_FLAG_QR | DNS_FLAG_RD;
+    out[3] = DNS_FLAG_RA;
+    dns_write_u16(out + 6, 1);
+    dns_write_u16(out + 10, 0);  // EDNS OPT is not echoed
+    memcpy(out + n, slot->rr, LOCAL_ANSWER_RR_SIZE);
+    *rule = slot->rule;
+    return n + LOCAL_ANSWER_RR_SIZE;
+  }
+
+ protected:
+  struct Slot {
+    uint32_t hash;
+    const uint8_t *name;
+    uint16_t rule;
+    uint8_t rr[LOCAL_ANSWER_RR_SIZE];  // Answer record, owner name pointing at the question
+  };
+
+  static void fill_rr(Slot &slot, uint32_t ip) {
+    dns_write_u16(slot.rr, 0xC000 | DNS_HEADER_SIZE);
+    dns_write_u16(slot.rr + 2, DNS_TYPE_A);
+    dns_write_u16(slot.rr + 4, DNS_CLASS_IN);
+    dns_write_u32(slot.rr + 6, LOCAL_ANSWER_TTL);
+    dns_write_u16(slot.rr + 10, 4);
+    memcpy(slot.rr + 12, &ip, 4);  // Already in network order
+  }
+
+  const Slot *find(const uint8_t *name, uint32_t hash) const {
+    size_t mask = slots_.size() - 1;
+    uint16_t probes = 0;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      const Slot &slot = slots_[i];
+      probes++;
+      if (slot.name == nullptr) {
+        probe_stats_.record(probes);
+        return nullptr;
+      }
+      if (slot.hash == hash && dns_name_equal(slot.name, name)) {
+        probe_stats_.record(probes);
+        return &slot;
+      }
+    }
+  }
+
+  std::vector<Slot> pending_;
+  std::vector<Slot> slots_;
+  mutable ProbeStats probe_stats_;
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+#ifdef USE_DNS_PROXY_MDNS
+
+#include "dns_message.h"
+#include <mdns.h>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+namespace dns_proxy {
+
+static const uint8_t MDNS_MAX_LOOKUPS = 4;
+static const uint8_t MDNS_MAX_ADDRESSES = 4;
+static const uint8_t MDNS_MAX_HOST = 64;
+// mDNS hosts announce 120 s; never keep a bridged answer longer than that.
+static const uint32_t MDNS_MAX_TTL = 120;
+static const uint8_t MDNS_NO_LOOKUP = 0xFF;
+
+enum class MdnsLookupState : uint8_t {
+  FREE,
+  REQUESTED,  // Filled in by the tcpip thread, waiting for the main loop
+  RUNNING,    // mDNS search in progress (main loop only)
+  DONE,       // Results ready for the tcpip thread
+};
+
+struct MdnsLookup {
+  std::atomic<MdnsLookupState> state{MdnsLookupState::FREE};
+  uint16_t qtype;
+  char host[MDNS_MAX_HOST];  // Without the ".local" suffix
+  mdns_search_once_t *search{nullptr};
+  uint8_t address_count;
+  uint8_t address_len;  // 4 for A, 16 for AAAA
+  uint8_t addresses[MDNS_MAX_ADDRESSES][16];
+  uint32_t ttl;
+};
+
+// A handful of outstanding mDNS host lookups shared between the tcpip thread,
+// which requests them and consumes the results, and the main loop, which
+// drives the ESP-IDF mDNS search API. Each slot is handed back and forth
+// through its state; only the current owner touches the other fields.
+class MdnsBridge {
+ public:
+  void set_timeout(uint32_t timeout_ms) { timeout_ms_ = timeout_ms; }
+  uint32_t get_timeout() const { return timeout_ms_; }
+
+  MdnsLookup &lookup(uint8_t index) { return lookups_[index]; }
+
+  // tcpip thread: joins a lookup already under way for the same host and
+  // type, or requests a new one. Returns MDNS_NO_LOOKUP if all are busy.
+  uint8_t request(const char *host, uint16_t qtype) {
+    uint8_t free = MDNS_NO_LOOKUP;
+    for (uint8_t i = 0; i < MDNS_MAX_LOOKUPS; i++) {
+      MdnsLookup &lookup = lookups_[i];
+      MdnsLookupState state = lookup.state.load(std::memory_order_acquire);
+      if (state == MdnsLookupState::FREE) {
+        if (free == MDNS_NO_LOOKUP) free = i;
+      } else if (lookup.qtype == qtype && strcmp(lookup.host, host) == 0) {
+        return i;
+      }
+    }
+    if (free == MDNS_NO_LOOKUP) return MDNS_NO_LOOKUP;
+
+    MdnsLookup &lookup = lookups_[free];
+    lookup.qtype = qtype;
+    strncpy(lookup.host, host, sizeof(lookup.host) - 1);
+    lookup.host[sizeof(lookup.host) - 1] = '\0';
+    lookup.state.store(MdnsLookupState::REQUESTED, std::memory_order_release);
+    return free;
+  }
+
+  // Main loop: starts requested searches and collects finished ones. Returns
+  // true if any results are waiting for the tcpip thread.
+  bool poll() {
+    bool done = false;
+    for (auto &lookup : lookups_) {
+      switch (lookup.state.load(std::memory_order_acquire)) {
+        case MdnsLookupState::REQUESTED:
+          lookup.address_count = 0;
+          lookup.search = mdns_query_async_new(lookup.host, nullptr, nullptr,
+                                               lookup.qtype == DNS_TYPE_AAAA ? MDNS_TYPE_AAAA : MDNS_TYPE_A,
+                                               timeout_ms_, 1, nullptr);
+          lookup.state.store(lookup.search != nullptr ? MdnsLookupState::RUNNING : MdnsLookupState::DONE,
+                             std::memory_order_release);
+          break;
+
+        case MdnsLookupState::RUNNING: {
+          mdns_result_t *results = nullptr;
+          uint8_t count = 0;
+          if (!mdns_query_async_get_results(lookup.search, 0, &results, &count)) break;
+          collect(lookup, results);
+          mdns_query_results_free(results);
+          mdns_query_async_delete(lookup.search);
+          lookup.search = nullptr;
+          lookup.state.store(MdnsLookupState::DONE, std::memory_order_release);
+          done = true;
+          break;
+        }
+
+        case MdnsLookupState::DONE:
+          done = true;
+          break;
+
+        case MdnsLookupState::FREE:
+          break;
+      }
+    }
+    return done;
+  }
+
+  // tcpip thread: hands a consumed slot back.
+  void release(uint8_t index) { lookups_[index].state.store(MdnsLookupState::FREE, std::memory_order_release); }
+
+ protected:
+  static void collect(MdnsLookup &lookup, const mdns_result_t *results) {
+    bool v6 = lookup.qtype == DNS_TYPE_AAAA;
+    lookup.address_len = v6 ? 16 : 4;
+    lookup.ttl = MDNS_MAX_TTL;
+    for (const mdns_result_t *r = results; r != nullptr; r = r->next) {
+      if (r->ttl > 0 && r->ttl < lookup.ttl) lookup.ttl = r->ttl;
+      for (const mdns_ip_addr_t *a = r->addr; a != nullptr && lookup.address_count < MDNS_MAX_ADDRESSES; a = a->next) {
+        if (v6 && a->addr.type == ESP_IPADDR_TYPE_V6) {
+          memcpy(lookup.addresses[lookup.address_count++], a->addr.u_addr.ip6.addr, 16);
+        } else if (!v6 && a->addr.type == ESP_IPADDR_TYPE_V4) {
+          memcpy(lookup.addresses[lookup.address_count++], &a->addr.u_addr.ip4.addr, 4);
+        }
+      }
+    }
+  }
+
+  MdnsLookup lookups_[MDNS_MAX_LOOKUPS];
+  uint32_t timeout_ms_{1000};
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
+
+#endif  // USE_DNS_PROXY_MDNS
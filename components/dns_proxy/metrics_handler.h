@@ -0,0 +1,267 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+#ifdef USE_DNS_PROXY_METRICS
+
+#include "esphome/core/component.h"
+#include "esphome/components/web_server_base/web_server_base.h"
+#include "dns_proxy.h"
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+namespace esphome {
+namespace dns_proxy {
+
+static const char *const METRICS_CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8";
+
+// Formats into a small fixed buffer and hands each full buffer to the web
+// server as one chunk, so the response is never assembled in memory. A
+// single line longer than the buffer gets a heap buffer of its own.
+class MetricsWriter {
+ public:
+#ifdef USE_ESP_IDF
+  explicit MetricsWriter(httpd_req_t *req) : req_(req) {}
+#else
+  explicit MetricsWriter(AsyncResponseStream *stream) : stream_(stream) {}
+#endif
+
+  void printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+      va_list args;
+      va_start(args, format);
+      int n = vsnprintf(buf_ + len_, sizeof(buf_) - len_, format, args);
+      va_end(args);
+      if (n < 0) return;
+      if (len_ + n < sizeof(buf_)) {
+        len_ += n;
+        return;
+      }
+      if (len_ == 0) {
+        // Longer than the whole buffer: format it on the heap and send it as
+        // is. Dropping it if that fails keeps the exposition valid.
+        char *line = static_cast<char *>(malloc(n + 1));
+        if (line == nullptr) return;
+        va_start(args, format);
+        vsnprintf(line, n + 1, format, args);
+        va_end(args);
+        send(line, n);
+        free(line);
+        return;
+      }
+      // Didn't fit: send what we have and format again into an empty buffer
+      flush();
+    }
+  }
+
+  void flush() {
+    send(buf_, len_);
+    len_ = 0;
+  }
+
+ protected:
+#ifdef USE_ESP_IDF
+  httpd_req_t *req_;
+#else
+  AsyncResponseStream *stream_;
+#endif
+  void send(const char *data, size_t len) {
+    if (len == 0) return;
+#ifdef USE_ESP_IDF
+    httpd_resp_send_chunk(req_, data, len);
+#else
+    stream_->write(reinterpret_cast<const uint8_t *>(data), len);
+#endif
+  }
+
+  char buf_[256];
+  size_t len_{0};
+};
+
+// Serves all DnsRedirect counters, windows and histograms in the Prometheus
+// text exposition format on the web_server.
+class DnsMetricsHandler : public AsyncWebHandler, public Component {
+ public:
+  DnsMetricsHandler(DnsRedirect *parent, web_server_base::WebServerBase *base, const char *path)
+      : parent_(parent), base_(base), path_(path) {}
+
+  bool canHandle(AsyncWebServerRequest *request) override {
+    return request->method() == HTTP_GET && request->url() == this->path_;
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override {
+#ifdef USE_ESP_IDF
+    httpd_req_t *req = *request;
+    httpd_resp_set_type(req, METRICS_CONTENT_TYPE);
+    MetricsWriter out(req);
+    this->write_metrics(out);
+    out.flush();
+    httpd_resp_send_chunk(req, nullptr, 0);
+#else
+    AsyncResponseStream *stream = request->beginResponseStream(METRICS_CONTENT_TYPE);
+    MetricsWriter out(stream);
+    this->write_metrics(out);
+    out.flush();
+    request->send(stream);
+#endif
+  }
+
+  void setup() override {
+    this->base_->init();
+    this->base_->add_handler(this);
+  }
+
+  float get_setup_priority() const override { return setup_priority::WIFI - 1.0f; }
+
+ protected:
+  void write_metrics(MetricsWriter &out) {
+    const DnsRedirect *dns = this->parent_;
+
+    counter(out, "queries_total", "Queries received", dns->get_query_count());
+    counter(out, "fast_path_total", "Local A queries answered from the prebuilt table", dns->get_fast_path_count());
+    counter(out, "forwarded_total", "Queries sent upstream", dns->get_forwarded_count());
+    counter(out, "prefetch_total", "Sibling A/AAAA/HTTPS queries sent ahead of the client", dns->get_prefetch_count());
+    counter(out, "timeouts_total", "Upstream resolutions that timed out", dns->get_timeout_count());
+    counter(out, "dropped_total", "Queries shed because the pending pool was full", dns->get_dropped_count());
+    counter(out, "heap_shed_total", "Queries turned away by the lowered pending limit under heap pressure",
+            dns->get_heap_shed_count());
+    counter(out, "cache_hits_total", "Queries answered from the cache", dns->get_cache_hits());
+    counter(out, "cache_misses_total", "Cache lookups without a live entry", dns->get_cache_misses());
+    counter(out, "cache_evictions_total", "Cache entries evicted to make room", dns->get_cache_evictions());
+    counter(out, "cache_promotions_total", "Cache entries copied into the internal RAM tier",
+            dns->get_cache_promotions());
+    counter(out, "cache_demotions_total", "Cache entries dropped from the internal RAM tier to make room",
+            dns->get_cache_demotions());
+    counter(out, "cache_expired_total", "Expired cache entries reclaimed by maintenance", dns->get_cache_expired());
+    counter(out, "maintenance_deferred_total", "Maintenance slices that ran out of budget",
+            dns->get_maintenance_deferred_count());
+    counter(out, "power_save_transitions_total", "Adaptive modem sleep switches",
+            dns->get_power_save_transitions());
+
+    gauge(out, "records", "Configured local records", dns->get_record_count());
+    gauge(out, "records_unused", "Local records that have not answered a query", dns->get_unused_rule_count());
+    gauge(out, "pending", "Resolutions in flight", dns->get_pending_count());
+    gauge(out, "upstream_inflight", "Forwarded queries waiting for an upstream answer", dns->get_upstream_inflight());
+    gauge(out, "upstream_queued", "Forwards waiting for upstream capacity", dns->get_upstream_queued());
+    gauge(out, "cache_entries", "Entries in the response cache", dns->get_cache_size());
+    gauge(out, "cache_capacity", "Capacity of the response cache", dns->get_cache_capacity());
+    gauge(out, "cache_hot_entries", "Entries in the internal RAM cache tier", dns->get_hot_cache_size());
+    gauge(out, "infra_zones", "Delegations in the infrastructure cache", dns->get_infra_zone_count());
+    gauge(out, "names", "Distinct names in the name arena", dns->get_name_count());
+    gauge(out, "name_arena_used_bytes", "Name arena bytes in use", dns->get_name_arena_used());
+    gauge(out, "name_arena_capacity_bytes", "Size of the name arena", dns->get_name_arena_capacity());
+    gauge(out, "free_heap_bytes", "Free heap", dns->get_free_heap());
+    gauge(out, "free_internal_heap_bytes", "Free internal RAM", dns->get_free_internal_heap());
+    gauge(out, "largest_free_block_bytes", "Largest free block of internal RAM", dns->get_largest_free_block());
+    gauge(out, "heap_pressure", "Heap pressure level (0 none, 1 moderate, 2 critical)",
+          static_cast<uint8_t>(dns->get_heap_pressure()));
+    gauge(out, "pending_limit", "Queries admitted at once", dns->get_pending_limit());
+    gauge(out, "up", "DNS server is listening", dns->is_running() ? 1 : 0);
+
+    if (dns->get_hot_cache_capacity() > 0) {  // Only split with PSRAM
+      out.printf("# HELP dns_proxy_cache_tier_hits_total Cache hits per memory tier\n"
+                 "# TYPE dns_proxy_cache_tier_hits_total counter\n"
+                 "dns_proxy_cache_tier_hits_total{tier=\"sram\"} %u\n"
+                 "dns_proxy_cache_tier_hits_total{tier=\"psram\"} %u\n",
+                 (unsigned) dns->get_hot_cache_hits(), (unsigned) (dns->get_cache_hits() - dns->get_hot_cache_hits()));
+    }
+    out.printf("# HELP dns_proxy_cache_shard_hits_total Cache hits per shard\n"
+               "# TYPE dns_proxy_cache_shard_hits_total counter\n");
+    for (uint8_t i = 0; i < dns->get_cache_shard_count(); i++) {
+      out.printf("dns_proxy_cache_shard_hits_total{shard=\"%u\"} %u\n", i,
+                 (unsigned) dns->get_cache_shard(i).hits.load(std::memory_order_relaxed));
+    }
+    out.printf("# HELP dns_proxy_cache_shard_evictions_total Cache evictions per shard\n"
+               "# TYPE dns_proxy_cache_shard_evictions_total counter\n");
+    for (uint8_t i = 0; i < dns->get_cache_shard_count(); i++) {
+      out.printf("dns_proxy_cache_shard_evictions_total{shard=\"%u\"} %u\n", i,
+                 (unsigned) dns->get_cache_shard(i).evictions.load(std::memory_order_relaxed));
+    }
+    out.printf("# HELP dns_proxy_cache_shard_entries Entries per cache shard\n"
+               "# TYPE dns_proxy_cache_shard_entries gauge\n");
+    for (uint8_t i = 0; i < dns->get_cache_shard_count(); i++) {
+      out.printf("dns_proxy_cache_shard_entries{shard=\"%u\"} %u\n", i,
+                 (unsigned) dns->get_cache_shard(i).size.load(std::memory_order_relaxed));
+    }
+
+    const ProbeStats *probes[3] = {&dns->get_name_probe_stats(), &dns->get_cache_probe_stats(),
+                                   &dns->get_fast_path_probe_stats()};
+    static const char *const TABLE_NAMES[3] = {"names", "cache", "fast_path"};
+    out.printf("# HELP dns_proxy_hash_lookups_total Hash table lookups\n"
+               "# TYPE dns_proxy_hash_lookups_total counter\n");
+    for (uint8_t i = 0; i < 3; i++) {
+      out.printf("dns_proxy_hash_lookups_total{table=\"%s\"} %u\n", TABLE_NAMES[i], (unsigned) probes[i]->lookups);
+    }
+    out.printf("# HELP dns_proxy_hash_probes_total Entries compared by hash table lookups\n"
+               "# TYPE dns_proxy_hash_probes_total counter\n");
+    for (uint8_t i = 0; i < 3; i++) {
+      out.printf("dns_proxy_hash_probes_total{table=\"%s\"} %u\n", TABLE_NAMES[i], (unsigned) probes[i]->probes);
+    }
+    out.printf("# HELP dns_proxy_hash_probes_max Longest hash table lookup since boot\n"
+               "# TYPE dns_proxy_hash_probes_max gauge\n");
+    for (uint8_t i = 0; i < 3; i++) {
+      out.printf("dns_proxy_hash_probes_max{table=\"%s\"} %u\n", TABLE_NAMES[i], (unsigned) probes[i]->max);
+    }
+
+    static const char *const METRIC_NAMES[METRIC_COUNT] = {"queries", "local_hits", "cache_hits",
+                                                           "forwards", "timeouts", "sheds"};
+    out.printf("# HELP dns_proxy_rate Events per second over a sliding window\n"
+               "# TYPE dns_proxy_rate gauge\n");
+    for (uint8_t i = 0; i < METRIC_COUNT; i++) {
+      Metric metric = static_cast<Metric>(i);
+      out.printf("dns_proxy_rate{metric=\"%s\",window=\"1m\"} %.3f\n", METRIC_NAMES[i], dns->get_rate_1m(metric));
+      out.printf("dns_proxy_rate{metric=\"%s\",window=\"15m\"} %.3f\n", METRIC_NAMES[i], dns->get_rate_15m(metric));
+    }
+    out.printf("# HELP dns_proxy_peak_qps Most queries seen in one second within the window\n"
+               "# TYPE dns_proxy_peak_qps gauge\n"
+               "dns_proxy_peak_qps{window=\"1m\"} %u\n"
+               "dns_proxy_peak_qps{window=\"15m\"} %u\n",
+               (unsigned) dns->get_peak_qps_1m(), (unsigned) dns->get_peak_qps_15m());
+
+    out.printf("# HELP dns_proxy_upstream_latency_ms Time from forwarding to answering the client\n"
+               "# TYPE dns_proxy_upstream_latency_ms histogram\n");
+    histogram(out, "upstream_latency_ms", "", dns->get_upstream_latency());
+
+    out.printf("# HELP dns_proxy_queue_delay_ms Time forwards waited for upstream capacity\n"
+               "# TYPE dns_proxy_queue_delay_ms histogram\n");
+    histogram(out, "queue_delay_ms", "class=\"quiet\"", dns->get_queue_delay(QueueClass::QUIET));
+    histogram(out, "queue_delay_ms", "class=\"busy\"", dns->get_queue_delay(QueueClass::BUSY));
+  }
+
+  // Bucket, sum and count lines of one histogram series; labels may be empty.
+  static void histogram(MetricsWriter &out, const char *name, const char *labels, const LatencyHistogram &latency) {
+    const char *sep = labels[0] != '\0' ? "," : "";
+    const char *open = labels[0] != '\0' ? "{" : "";
+    const char *close = labels[0] != '\0' ? "}" : "";
+    uint32_t cumulative = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS - 1; i++) {
+      cumulative += latency.bucket(i);
+      out.printf("dns_proxy_%s_bucket{%s%sle=\"%u\"} %u\n", name, labels, sep, LATENCY_BOUNDS_MS[i],
+                 (unsigned) cumulative);
+    }
+    cumulative += latency.bucket(LATENCY_BUCKETS - 1);
+    out.printf("dns_proxy_%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, sep, (unsigned) cumulative);
+    out.printf("dns_proxy_%s_sum%s%s%s %u\n", name, open, labels, close, (unsigned) latency.sum_ms());
+    out.printf("dns_proxy_%s_count%s%s%s %u\n", name, open, labels, close, (unsigned) cumulative);
+  }
+
+  static void counter(MetricsWriter &out, const char *name, const char *help, uint32_t value) {
+    out.printf("# HELP dns_proxy_%s %s\n# TYPE dns_proxy_%s counter\ndns_proxy_%s %u\n", name, help, name, name,
+               (unsigned) value);
+  }
+
+  static void gauge(MetricsWriter &out, const char *name, const char *help, uint32_t value) {
+    out.printf("# HELP dns_proxy_%s %s\n# TYPE dns_proxy_%s gauge\ndns_proxy_%s %u\n", name, help, name, name,
+               (unsigned) value);
+  }
+
+  DnsRedirect *parent_;
+  web_server_base::WebServerBase *base_;
+  const char *path_;
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
+
+#endif  // USE_DNS_PROXY_METRICS
@@ -0,0 +1,275 @@
+#pragma once
+
+#include "dns_message.h"
+#include "platform.h"
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+namespace dns_proxy {
+
+// Secret key of all name hashes, drawn at boot by dns_hash_seed(). With a
+// key nobody on the network knows, names can't be crafted to land in one
+// bucket and turn lookups on the tcpip thread into long chain walks.
+inline uint32_t dns_hash_key[2] = {0, 0};  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// Before anything is hashed: stored hashes don't survive a key change.
+inline void dns_hash_seed() {
+  dns_hash_key[0] = dns_random();
+  dns_hash_key[1] = dns_random();
+}
+
+// HalfSipHash-1-3, the 32-bit SipHash variant, fed one byte at a time so a
+// name can be lower-cased and hashed while it is being walked.
+class NameHasher {
+ public:
+  NameHasher() : v0_(dns_hash_key[0]), v1_(dns_hash_key[1]) {
+    v2_ = 0x6c796765u ^ v0_;
+    v3_ = 0x74656462u ^ v1_;
+  }
+
+  void add(uint8_t byte) {
+    word_ |= (uint32_t) byte << (8 * (len_ & 3));
+    if ((++len_ & 3) == 0) {
+      compress(word_);
+      word_ = 0;
+    }
+  }
+
+  uint32_t finish() {
+    compress(word_ | (uint32_t) len_ << 24);
+    v2_ ^= 0xFF;
+    round();
+    round();
+    round();
+    return v1_ ^ v3_;
+  }
+
+ protected:
+  static uint32_t rotl(uint32_t x, uint8_t b) { return (x << b) | (x >> (32 - b)); }
+
+  void round() {
+    v0_ += v1_;
+    v1_ = rotl(v1_, 5) ^ v0_;
+    v0_ = rotl(v0_, 16);
+    v2_ += v3_;
+    v3_ = rotl(v3_, 8) ^ v2_;
+    v0_ += v3_;
+    v3_ = rotl(v3_, 7) ^ v0_;
+    v2_ += v1_;
+    v1_ = rotl(v1_, 13) ^ v2_;
+    v2_ = rotl(v2_, 16);
+  }
+
+  void compress(uint32_t m) {
+    v3_ ^= m;
+    round();
+    v0_ ^= m;
+  }
+
+  uint32_t v0_, v1_, v2_, v3_;
+  uint32_t word_{0};
+  uint8_t len_{0};
+};
+
+// Keyed hash of the lower-cased wire name.
+inline uint32_t dns_hash_wire(const uint8_t *name) {
+  NameHasher hasher;
+  for (size_t n = 0, len = dns_name_length(name); n < len; n++) hasher.add(dns_lower(name[n]));
+  return hasher.finish();
+}
+
+// Continues a name hash with the query type, giving a (name, type) key.
+inline uint32_t dns_hash_type(uint32_t name_hash, uint16_t qtype) {
+  name_hash = (name_hash ^ (qtype >> 8)) * 16777619u;
+  return (name_hash ^ (qtype & 0xFF)) * 16777619u;
+}
+
+// Chain or probe lengths seen by a table's lookups. The tcpip thread writes,
+// readers may see slightly stale values.
+struct ProbeStats {
+  uint32_t lookups{0};
+  uint32_t probes{0};  // Entries compared, summed over all lookups
+  uint16_t max{0};     // Longest single lookup since boot
+
+  void record(uint16_t n) {
+    lookups++;
+    probes += n;
+    if (n > max) max = n;
+  }
+};
+
+// 32-bit reference to an interned name; 0 is never a valid handle.
+typedef uint32_t NameHandle;
+static const NameHandle NAME_NONE = 0;
+
+static const size_t NAME_CELL_SIZE = 32;
+static const uint16_t NAME_CELL_NONE = 0xFFFF;
+static const uint16_t NAME_TAG_NONE = 0xFFFF;
+
+// Deduplicated, reference-counted store of lower-cased wire names in one
+// contiguous block of 32-byte cells. A name occupies consecutive cells
+// starting with a small header that carries its precomputed hash. Records,
+// cache entries and delegations hold handles instead of their own copies, so
+// equal names are stored once and compared as integers.
+// Only touched from the tcpip thread.
+class NameArena {
+ public:
+  bool init(uint16_t cells) {
+    if (cells == 0 || cells >= NAME_CELL_NONE) return false;
+    bucket_count_ = 1;
+    while (bucket_count_ < cells / 2) bucket_count_ <<= 1;
+    cells_ = static_cast<uint8_t *>(dns_alloc_large(NAME_CELL_SIZE * cells));
+    used_ = static_cast<uint32_t *>(dns_alloc_large(sizeof(uint32_t) * ((cells + 31) / 32)));
+    buckets_ = static_cast<uint16_t *>(dns_alloc_large(sizeof(uint16_t) * bucket_count_));
+    if (cells_ == nullptr || used_ == nullptr || buckets_ == nullptr) {
+      dns_free_large(cells_);
+      dns_free_large(used_);
+      dns_free_large(buckets_);
+      cells_ = nullptr;
+      used_ = nullptr;
+      buckets_ = nullptr;
+      return false;
+    }
+    cell_count_ = cells;
+    for (uint16_t i = 0; i < bucket_count_; i++) buckets_[i] = NAME_CELL_NONE;
+    return true;
+  }
+
+  bool enabled() const { return cells_ != nullptr; }
+  uint32_t get_capacity_bytes() const { return (uint32_t) cell_count_ * NAME_CELL_SIZE; }
+  uint32_t get_used_bytes() const { return (uint32_t) cells_used_ * NAME_CELL_SIZE; }
+  uint16_t get_name_count() const { return name_count_; }
+  uint32_t get_full_count() const { return full_count_; }
+  const ProbeStats &get_probe_stats() const { return probe_stats_; }
+  void restore_probe_stats(const ProbeStats &saved) { probe_stats_ = saved; }
+
+  // Handle of an already interned name, without taking a reference.
+  NameHandle find(const uint8_t *name) const { return find(name, dns_hash_wire(name)); }
+  NameHandle find(const uint8_t *name, uint32_t hash) const {
+    if (!enabled()) return NAME_NONE;
+    uint16_t probes = 0;
+    for (uint16_t cell = buckets_[hash & (bucket_count_ - 1)]; cell != NAME_CELL_NONE; cell = header(cell).next) {
+      const Header &h = header(cell);
+      probes++;
+      if (h.hash == hash && dns_name_equal(data(cell), name)) {
+        probe_stats_.record(probes);
+        return cell + 1;
+      }
+    }
+    probe_stats_.record(probes);
+    return NAME_NONE;
+  }
+
+  // Returns the handle for name with one more reference, adding it if
+  // needed. NAME_NONE if the arena is full.
+  NameHandle intern(const uint8_t *name) { return intern(name, dns_hash_wire(name)); }
+  NameHandle intern(const uint8_t *name, uint32_t hash) {
+    NameHandle handle = find(name, hash);
+    if (handle != NAME_NONE) {
+      acquire(handle);
+      return handle;
+    }
+    if (!enabled()) return NAME_NONE;
+
+    size_t len = dns_name_length(name);
+    uint8_t need = (sizeof(Header) + len + NAME_CELL_SIZE - 1) / NAME_CELL_SIZE;
+    uint16_t cell = allocate(need);
+    if (cell == NAME_CELL_NONE) {
+      full_count_++;
+      return NAME_NONE;
+    }
+
+    Header &h = header(cell);
+    h.hash = hash;
+    h.refs = 1;
+    h.len = len;
+    h.cells = need;
+    h.tag = NAME_TAG_NONE;
+    uint8_t *out = data(cell);
+    for (size_t i = 0; i < len; i++) out[i] = dns_lower(name[i]);
+    uint16_t &bucket = buckets_[hash & (bucket_count_ - 1)];
+    h.next = bucket;
+    bucket = cell;
+    name_count_++;
+    return cell + 1;
+  }
+
+  void acquire(NameHandle handle) {
+    if (handle != NAME_NONE) header(handle - 1).refs++;
+  }
+
+  // Drops one reference; the cells are reused once nothing refers to them.
+  void release(NameHandle handle) {
+    if (handle == NAME_NONE) return;
+    uint16_t cell = handle - 1;
+    Header &h = header(cell);
+    if (--h.refs > 0) return;
+
+    uint16_t *link = &buckets_[h.hash & (bucket_count_ - 1)];
+    while (*link != cell) link = &header(*link).next;
+    *link = h.next;
+    for (uint8_t i = 0; i < h.cells; i++) used_[(cell + i) / 32] &= ~(1u << ((cell + i) % 32));
+    cells_used_ -= h.cells;
+    name_count_--;
+  }
+
+  const uint8_t *name(NameHandle handle) const { return data(handle - 1); }
+  uint32_t hash(NameHandle handle) const { return header(handle - 1).hash; }
+  // A value the owner keeps with the name (NAME_TAG_NONE until set), so the
+  // lookup that finds a name also finds what hangs off it.
+  uint16_t tag(NameHandle handle) const { return header(handle - 1).tag; }
+  void set_tag(NameHandle handle, uint16_t tag) { header(handle - 1).tag = tag; }
+
+ protected:
+  struct Header {
+    uint32_t hash;
+    uint16_t next;  // Bucket chain (first cell of the next name)
+    uint16_t refs;
+    uint8_t len;
+    uint8_t cells;
+    uint16_t tag;  // Fills the padding after cells
+  };
+
+  Header &header(uint16_t cell) { return *reinterpret_cast<Header *>(cells_ + cell * NAME_CELL_SIZE); }
+  const Header &header(uint16_t cell) const {
+    return *reinterpret_cast<const Header *>(cells_ + cell * NAME_CELL_SIZE);
+  }
+  uint8_t *data(uint16_t cell) { return cells_ + cell * NAME_CELL_SIZE + sizeof(Header); }
+  const uint8_t *data(uint16_t cell) const { return cells_ + cell * NAME_CELL_SIZE + sizeof(Header); }
+
+  bool cell_used(uint16_t cell) const { return used_[cell / 32] & (1u << (cell % 32)); }
+
+  // First fit over the occupancy bitmap for `need` consecutive free cells.
+  uint16_t allocate(uint8_t need) {
+    uint16_t run = 0;
+    for (uint16_t cell = 0; cell < cell_count_; cell++) {
+      if (used_[cell / 32] == UINT32_MAX) {
+        run = 0;
+        cell |= 31;  // Skip a full word
+        continue;
+      }
+      run = cell_used(cell) ? 0 : run + 1;
+      if (run == need) {
+        uint16_t first = cell + 1 - need;
+        for (uint16_t i = first; i <= cell; i++) used_[i / 32] |= 1u << (i % 32);
+        cells_used_ += need;
+        return first;
+      }
+    }
+    return NAME_CELL_NONE;
+  }
+
+  uint8_t *cells_{nullptr};
+  uint32_t *used_{nullptr};
+  uint16_t *buckets_{nullptr};
+  uint16_t cell_count_{0};
+  uint16_t bucket_count_{0};
+  uint16_t cells_used_{0};
+  uint16_t name_count_{0};
+  uint32_t full_count_{0};
+  mutable ProbeStats probe_stats_;
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+#ifdef USE_DNS_PROXY_CAPTURE
+
+#include "dns_message.h"
+#include "platform.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+namespace dns_proxy {
+
+// Bytes of each packet kept; DNS over UDP without EDNS never exceeds this.
+static const uint16_t CAPTURE_SNAPLEN = 512;
+// pcap link type for raw IPv4 packets
+static const uint32_t CAPTURE_LINKTYPE_IPV4 = 228;
+
+enum class CaptureState : uint8_t {
+  OFF,
+  RUNNING,
+  FULL,  // Stopped automatically
+};
+
+// Fixed-size header in front of each captured payload. Addresses are IPv4 as
+// lwIP stores them; the IP/UDP headers are only synthesised on export.
+struct CaptureRecord {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t src_ip;
+  uint32_t dst_ip;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint16_t len;       // Bytes stored
+  uint16_t orig_len;  // Bytes on the wire
+};
+
+// Marks the reader count while start() clears the buffer.
+static const uint8_t CAPTURE_RESETTING = 0xFF;
+
+// Append-only packet buffer, in PSRAM when available. The tcpip thread
+// appends and publishes the new end with a release store; the web server
+// reads everything below that end between begin_read() and end_read(). A new
+// capture is refused while anyone reads, since it would write over the
+// records being read. Each packet costs one bounded copy, and capturing stops
+// by itself once the next packet doesn't fit.
+class PacketCapture {
+ public:
+  bool init(uint32_t size) {
+    buffer_ = static_cast<uint8_t *>(dns_alloc_large(size));
+    if (buffer_ == nullptr) return false;
+    size_ = size;
+    return true;
+  }
+
+  bool enabled() const { return buffer_ != nullptr; }
+  CaptureState state() const { return state_.load(std::memory_order_acquire); }
+  uint32_t used() const { return used_.load(std::memory_order_acquire); }
+  uint32_t capacity() const { return size_; }
+  uint32_t packet_count() const { return packets_.load(std::memory_order_acquire); }
+  const uint8_t *data() const { return buffer_; }
+
+  // tcpip thread: clears the buffer and starts capturing. Returns false
+  // while a download is reading the buffer.
+  bool start(uint32_t now_us) {
+    if (!enabled()) return false;
+    uint8_t idle = 0;
+    if (!readers_.compare_exchange_strong(idle, CAPTURE_RESETTING, std::memory_order_acquire)) return false;
+    used_.store(0, std::memory_order_release);
+    packets_.store(0, std::memory_order_release);
+    elapsed_us_ = 0;
+    last_us_ = now_us;
+    state_.store(CaptureState::RUNNING, std::memory_order_release);
+    readers_.store(0, std::memory_order_release);
+    return true;
+  }
+
+  // Any thread: holds off start() until end_read() and sets end to the end
+  // of the records that may be read. False, without a read to end, while
+  // start() is clearing the buffer.
+  bool begin_read(uint32_t *end) const {
+    uint8_t count = readers_.load(std::memory_order_relaxed);
+    do {
+      if (count >= CAPTURE_RESETTING - 1) return false;
+    } while (!readers_.compare_exchange_weak(count, count + 1, std::memory_order_acquire));
+    *end = used();
+    return true;
+  }
+  void end_read() const { readers_.fetch_sub(1, std::memory_order_release); }
+
+  void stop() {
+    CaptureState running = CaptureState::RUNNING;
+    state_.compare_exchange_strong(running, CaptureState::OFF);
+  }
+
+  // tcpip thread: stores the first len bytes of a packet of orig_len bytes.
+  // Returns false once the buffer has filled up.
+  bool add(const uint8_t *payload, uint16_t len, uint16_t orig_len, uint32_t src_ip, uint16_t src_port,
+           uint32_t dst_ip, uint16_t dst_port, uint32_t now_us) {
+    if (state_.load(std::memory_order_relaxed) != CaptureState::RUNNING) return true;
+
+    if (len > CAPTURE_SNAPLEN) len = CAPTURE_SNAPLEN;
+    uint32_t at = used_.load(std::memory_order_relaxed);
+    uint32_t need = (sizeof(CaptureRecord) + len + 3) & ~3u;
+    if (size_ - at < need) {
+      state_.store(CaptureState::FULL, std::memory_order_release);
+      return false;
+    }
+
+    elapsed_us_ += now_us - last_us_;
+    last_us_ = now_us;
+    CaptureRecord record{(uint32_t) (elapsed_us_ / 1000000), (uint32_t) (elapsed_us_ % 1000000),
+                         src_ip, dst_ip, src_port, dst_port, len, orig_len};
+    memcpy(buffer_ + at, &record, sizeof(record));
+    memcpy(buffer_ + at + sizeof(record), payload, len);
+    used_.store(at + need, std::memory_order_release);
+    packets_.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  // Walks the records below `end`: returns the offset of the next one, or 0.
+  // A record that doesn't fit below end ends the walk.
+  uint32_t next(uint32_t at, uint32_t end, CaptureRecord *record, const uint8_t **payload) const {
+    if (at + sizeof(CaptureRecord) > end) return 0;
+    memcpy(record, buffer_ + at, sizeof(CaptureRecord));
+    if (record->len > CAPTURE_SNAPLEN || at + sizeof(CaptureRecord) + record->len > end) return 0;
+    *payload = buffer_ + at + sizeof(CaptureRecord);
+    return at + ((sizeof(CaptureRecord) + record->len + 3) & ~3u);
+  }
+
+ protected:
+  uint8_t *buffer_{nullptr};
+  uint32_t size_{0};
+  std::atomic<uint32_t> used_{0};
+  std::atomic<uint32_t> packets_{0};
+  std::atomic<CaptureState> state_{CaptureState::OFF};
+  mutable std::atomic<uint8_t> readers_{0};  // Downloads in progress, or CAPTURE_RESETTING
+  uint64_t elapsed_us_{0};  // Since start, tcpip thread only
+  uint32_t last_us_{0};
+};
+
+// Writes the pcap file header for the capture into out (24 bytes).
+inline size_t pcap_file_header(uint8_t *out) {
+  const uint32_t header[6] = {0xA1B2C3D4, 0x00040002, 0, 0, CAPTURE_SNAPLEN + 28u, CAPTURE_LINKTYPE_IPV4};
+  memcpy(out, header, sizeof(header));  // Host byte order, as pcap readers expect
+  return sizeof(header);
+}
+
+// Writes one pcap record (record header, synthesised IPv4 and UDP headers,
+// payload) into out, which must hold 44 + CAPTURE_SNAPLEN bytes.
+inline size_t pcap_packet(const CaptureRecord &record, const uint8_t *payload, uint8_t *out) {
+  uint16_t ip_len = 28 + record.len;
+  const uint32_t header[4] = {record.ts_sec, record.ts_usec, ip_len, 28u + record.orig_len};
+  memcpy(out, header, sizeof(header));
+
+  uint8_t *ip = out + sizeof(header);
+  memset(ip, 0, 28);
+  ip[0] = 0x45;  // IPv4, 20-byte header
+  dns_write_u16(ip + 2, 28 + record.orig_len);
+  ip[8] = 64;  // TTL
+  ip[9] = 17;  // UDP
+  memcpy(ip + 12, &record.src_ip, 4);  // Already in network order
+  memcpy(ip + 16, &record.dst_ip, 4);
+  uint32_t sum = 0;
+  for (int i = 0; i < 20; i += 2) sum += dns_read_u16(ip + i);
+  while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+  dns_write_u16(ip + 10, ~sum & 0xFFFF);
+
+  uint8_t *udp = ip + 20;
+  dns_write_u16(udp, record.src_port);
+  dns_write_u16(udp + 2, record.dst_port);
+  dns_write_u16(udp + 4, 8 + record.orig_len);  // Checksum 0: not computed
+  memcpy(udp + 8, payload, record.len);
+  return sizeof(header) + ip_len;
+}
+
+}  // namespace dns_proxy
+}  // namespace esphome
+
+#endif  // USE_DNS_PROXY_CAPTURE
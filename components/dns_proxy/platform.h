@@ -0,0 +1,143 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+#include <lwip/dns.h>
+#include <lwip/ip_addr.h>
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef USE_ESP32
+#include <esp_heap_caps.h>
+#include <esp_netif.h>
+#include <esp_random.h>
+#include <esp_wifi.h>
+#else
+#include <random>
+#endif
+
+// Everything the proxy needs from the chip besides lwIP. The lwIP raw API
+// calls themselves stay as they are, so a host build linked against lwIP's
+// contrib unix port runs the same udp_recv/pbuf/udp_sendto path as a device;
+// only these helpers change.
+
+namespace esphome {
+namespace dns_proxy {
+
+#ifdef USE_ESP32
+
+// Allocates zeroed memory from PSRAM when the board has it, internal RAM otherwise.
+inline void *dns_alloc_large(size_t size) {
+  void *ptr = heap_caps_calloc(1, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (ptr == nullptr) ptr = heap_caps_calloc(1, size, MALLOC_CAP_DEFAULT);
+  return ptr;
+}
+inline void dns_free_large(void *ptr) { heap_caps_free(ptr); }
+
+// Zeroed internal RAM only, for small structures that are hit often; free
+// with dns_free_large().
+inline void *dns_alloc_internal(size_t size) {
+  return heap_caps_calloc(1, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+inline bool dns_has_psram() { return heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0; }
+
+inline uint32_t dns_free_heap() { return heap_caps_get_free_size(MALLOC_CAP_DEFAULT); }
+// Internal RAM is what runs out first: lwIP, WiFi and BLE can't use PSRAM.
+inline uint32_t dns_free_internal_heap() { return heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT); }
+inline uint32_t dns_largest_free_block() {
+  return heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+inline uint32_t dns_random() { return esp_random(); }
+
+typedef wifi_ps_type_t PowerSaveMode;
+static const PowerSaveMode POWER_SAVE_DEFAULT = WIFI_PS_MIN_MODEM;
+
+// Turns modem sleep off, remembering the previous mode. False if it was
+// already off or can't be changed.
+inline bool dns_power_save_suspend(PowerSaveMode *saved) {
+  return esp_wifi_get_ps(saved) == ESP_OK && *saved != WIFI_PS_NONE && esp_wifi_set_ps(WIFI_PS_NONE) == ESP_OK;
+}
+inline bool dns_power_save_restore(PowerSaveMode saved) { return esp_wifi_set_ps(saved) == ESP_OK; }
+
+// The DNS server handed out for the WiFi station interface.
+inline bool dns_platform_upstream(ip_addr_t *out) {
+  esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  if (netif == nullptr) {
+    ESP_LOGW("dns_proxy", "Could not get WiFi interface - forwarding disabled");
+    return false;
+  }
+  esp_netif_dns_info_t dns_info;
+  if (esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns_info) != ESP_OK) {
+    ESP_LOGW("dns_proxy", "Could not get WiFi DNS - forwarding disabled");
+    return false;
+  }
+  if (dns_info.ip.type != ESP_IPADDR_TYPE_V4) {
+    ESP_LOGW("dns_proxy", "IPv6 DNS not supported - forwarding disabled");
+    return false;
+  }
+  ip_addr_set_ip4_u32(out, dns_info.ip.u_addr.ip4.addr);
+  return true;
+}
+
+#else  // Host build on lwIP's unix port
+
+inline void *dns_alloc_large(size_t size) { return calloc(1, size); }
+inline void dns_free_large(void *ptr) { free(ptr); }
+inline void *dns_alloc_internal(size_t size) { return calloc(1, size); }
+// Memory is uniform on a host, as on boards without PSRAM.
+inline bool dns_has_psram() { return false; }
+
+// No meaningful figure on a host; the benchmark's heap delta reads 0 and the
+// heap guard stays off.
+inline uint32_t dns_free_heap() { return 0; }
+inline uint32_t dns_free_internal_heap() { return 0; }
+inline uint32_t dns_largest_free_block() { return 0; }
+
+inline uint32_t dns_random() {
+  static std::mt19937 rng{std::random_device{}()};
+  return rng();
+}
+
+// No radio, so there is no power save to manage.
+typedef uint8_t PowerSaveMode;
+static const PowerSaveMode POWER_SAVE_DEFAULT = 0;
+inline bool dns_power_save_suspend(PowerSaveMode * /*saved*/) { return false; }
+inline bool dns_power_save_restore(PowerSaveMode /*saved*/) { return true; }
+
+// Whatever the port was configured with through dns_setserver().
+inline bool dns_platform_upstream(ip_addr_t *out) {
+  const ip_addr_t *server = dns_getserver(0);
+  if (server == nullptr || !IP_IS_V4(server) || ip_addr_isany(server)) {
+    ESP_LOGW("dns_proxy", "No IPv4 DNS server configured - forwarding disabled");
+    return false;
+  }
+  ip_addr_copy(*out, *server);
+  return true;
+}
+
+#endif  // USE_ESP32
+
+// Time source for timeouts, TTL expiry and the rate windows. On a device this
+// is the HAL clock; a host build can install a virtual one with
+// dns_set_clock() and fast-forward through hours of expiry and retries.
+#ifdef USE_ESP32
+inline uint32_t dns_millis() { return millis(); }
+inline uint32_t dns_micros() { return micros(); }
+#else
+typedef uint32_t (*DnsClockFn)();
+inline DnsClockFn dns_millis_fn = &millis;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+inline DnsClockFn dns_micros_fn = &micros;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// Only while the proxy is idle (before setup or from the thread driving it).
+inline void dns_set_clock(DnsClockFn millis_fn, DnsClockFn micros_fn) {
+  dns_millis_fn = millis_fn;
+  dns_micros_fn = micros_fn;
+}
+inline uint32_t dns_millis() { return dns_millis_fn(); }
+inline uint32_t dns_micros() { return dns_micros_fn(); }
+#endif
+
+}  // namespace dns_proxy
+}  // namespace esphome
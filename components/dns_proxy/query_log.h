@@ -0,0 +1,190 @@
+#pragma once
+
+#include "dns_message.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+namespace esphome {
+namespace dns_proxy {
+
+// Names longer than this are truncated in the log.
+static const size_t RECENT_NAME_MAX = 64;
+static const uint32_t QUERY_LOG_NONE = 0;
+
+enum class QueryOutcome : uint8_t {
+  PENDING,  // Still waiting for upstream
+  LOCAL,
+  CACHED,
+  FORWARDED,
+  RECURSIVE,
+  MDNS,
+  NXDOMAIN,
+  SERVFAIL,
+  DROPPED,
+  FORMERR,  // Question could not be parsed
+};
+
+inline const char *query_outcome_to_string(QueryOutcome outcome) {
+  switch (outcome) {
+    case QueryOutcome::PENDING:
+      return "pending";
+    case QueryOutcome::LOCAL:
+      return "local";
+    case QueryOutcome::CACHED:
+      return "cached";
+    case QueryOutcome::FORWARDED:
+      return "forwarded";
+    case QueryOutcome::RECURSIVE:
+      return "recursive";
+    case QueryOutcome::MDNS:
+      return "mdns";
+    case QueryOutcome::NXDOMAIN:
+      return "nxdomain";
+    case QueryOutcome::SERVFAIL:
+      return "servfail";
+    case QueryOutcome::DROPPED:
+      return "dropped";
+    case QueryOutcome::FORMERR:
+      return "formerr";
+  }
+  return "unknown";
+}
+
+inline const char *dns_type_to_string(uint16_t qtype, char *buf, size_t cap) {
+  switch (qtype) {
+    case DNS_TYPE_A:
+      return "A";
+    case DNS_TYPE_NS:
+      return "NS";
+    case DNS_TYPE_CNAME:
+      return "CNAME";
+    case DNS_TYPE_SOA:
+      return "SOA";
+    case DNS_TYPE_PTR:
+      return "PTR";
+    case DNS_TYPE_MX:
+      return "MX";
+    case 16:
+      return "TXT";
+    case DNS_TYPE_AAAA:
+      return "AAAA";
+    case 33:
+      return "SRV";
+    case DNS_TYPE_HTTPS:
+      return "HTTPS";
+    default:
+      snprintf(buf, cap, "TYPE%u", qtype);
+      return buf;
+  }
+}
+
+struct RecentQuery {
+  uint32_t serial;      // Position in the overall query stream, starting at 1
+  uint32_t timestamp;   // millis() when the query arrived
+  uint32_t latency_us;  // Time to answer, 0 while pending
+  uint32_t client;      // IPv4, as lwIP stores it
+  uint16_t qtype;
+  QueryOutcome outcome;
+  char name[RECENT_NAME_MAX];
+};
+
+// Fixed-capacity ring of the most recent queries. Written only from the
+// tcpip thread; each slot is guarded by a sequence counter so the main loop
+// can read consistent copies without locking or tearing.
+class QueryLog {
+ public:
+  void init(uint8_t capacity) {
+    slots_.reset(new Slot[capacity]);
+    capacity_ = capacity;
+  }
+
+  bool enabled() const { return capacity_ > 0; }
+  uint8_t capacity() const { return capacity_; }
+  uint32_t head() const { return head_.load(std::memory_order_acquire); }
+
+  // Starts a new entry for the question in msg and returns its serial.
+  uint32_t add(const uint8_t *msg, size_t len, uint32_t client, uint32_t now) {
+    if (!enabled()) return QUERY_LOG_NONE;
+    uint32_t serial = head_.load(std::memory_order_relaxed) + 1;
+    Slot &slot = slots_[serial % capacity_];
+
+    begin_write(slot);
+    RecentQuery &entry = slot.entry;
+    entry.serial = serial;
+    entry.timestamp = now;
+    entry.latency_us = 0;
+    entry.client = client;
+    entry.outcome = QueryOutcome::PENDING;
+    size_t name_end;
+    if (!dns_parse_question(msg, len, &name_end, &entry.qtype)) entry.qtype = 0;
+    name_to_text(msg, len, entry.name);
+    end_write(slot);
+
+    head_.store(serial, std::memory_order_release);
+    return serial;
+  }
+
+  // Records how a query ended, unless its slot has been reused meanwhile.
+  void complete(uint32_t serial, QueryOutcome outcome, uint32_t latency_us) {
+    if (serial == QUERY_LOG_NONE) return;
+    Slot &slot = slots_[serial % capacity_];
+    if (slot.entry.serial != serial) return;
+    begin_write(slot);
+    slot.entry.outcome = outcome;
+    slot.entry.latency_us = latency_us;
+    end_write(slot);
+  }
+
+  // Copies the entry with the given serial. Returns false if it has been
+  // overwritten or was being written while we looked.
+  bool read(uint32_t serial, RecentQuery &out) const {
+    if (serial == QUERY_LOG_NONE || !enabled()) return false;
+    const Slot &slot = slots_[serial % capacity_];
+    for (int attempt = 0; attempt < 3; attempt++) {
+      uint32_t before = slot.seq.load(std::memory_order_acquire);
+      if (before & 1) continue;
+      memcpy(&out, &slot.entry, sizeof(RecentQuery));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) == before) return out.serial == serial;
+    }
+    return false;
+  }
+
+ protected:
+  struct Slot {
+    std::atomic<uint32_t> seq{0};  // Odd while being written
+    RecentQuery entry{};
+  };
+
+  static void begin_write(Slot &slot) {
+    slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  static void end_write(Slot &slot) {
+    slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Dotted text form of the question name, truncated to RECENT_NAME_MAX.
+  static void name_to_text(const uint8_t *msg, size_t len, char *out) {
+    size_t n = 0;
+    size_t pos = DNS_HEADER_SIZE;
+    while (pos < len && msg[pos] != 0 && msg[pos] <= 63) {
+      uint8_t label = msg[pos++];
+      if (n > 0 && n < RECENT_NAME_MAX - 1) out[n++] = '.';
+      for (uint8_t i = 0; i < label && pos < len; i++, pos++) {
+        if (n < RECENT_NAME_MAX - 1) out[n++] = msg[pos];
+      }
+    }
+    out[n] = '\0';
+  }
+
+  std::unique_ptr<Slot[]> slots_;
+  uint8_t capacity_{0};
+  std::atomic<uint32_t> head_{0};
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
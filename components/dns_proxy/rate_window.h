@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace esphome {
+namespace dns_proxy {
+
+enum class Metric : uint8_t {
+  QUERIES,
+  LOCAL_HITS,
+  CACHE_HITS,
+  FORWARDS,
+  TIMEOUTS,
+  SHEDS,
+  COUNT,
+};
+
+static const uint8_t METRIC_COUNT = static_cast<uint8_t>(Metric::COUNT);
+
+// Sliding-window event rates: 60 one-second buckets (last minute) and 15
+// one-minute buckets (last quarter hour) per metric. Buckets are recycled
+// lazily by comparing their epoch, so there is no periodic work. The tcpip
+// thread is the only writer; readers on the main loop use plain atomic loads
+// and may at worst see a bucket that is just being recycled.
+class RateWindow {
+ public:
+  static const uint8_t SECONDS = 60;
+  static const uint8_t MINUTES = 15;
+
+  void add(Metric metric, uint32_t now_ms) {
+    uint32_t sec = now_ms / 1000;
+    uint32_t min = sec / 60;
+    Bucket &second = roll(seconds_[sec % SECONDS], sec);
+    Bucket &minute = roll(minutes_[min % MINUTES], min);
+    uint8_t m = static_cast<uint8_t>(metric);
+    uint32_t in_second = second.counts[m].fetch_add(1, std::memory_order_relaxed) + 1;
+    minute.counts[m].fetch_add(1, std::memory_order_relaxed);
+
+    // Busiest second inside each minute, so bursts stay visible over 15 minutes
+    if (metric == Metric::QUERIES && in_second > minute.peak.load(std::memory_order_relaxed)) {
+      minute.peak.store(in_second, std::memory_order_relaxed);
+    }
+  }
+
+  // Events per second over the last minute / 15 minutes.
+  float rate_1m(Metric metric, uint32_t now_ms) const {
+    return sum(seconds_, SECONDS, now_ms / 1000, metric) / (float) SECONDS;
+  }
+  float rate_15m(Metric metric, uint32_t now_ms) const {
+    return sum(minutes_, MINUTES, now_ms / 60000, metric) / (float) (MINUTES * 60);
+  }
+
+  uint32_t total_1m(Metric metric, uint32_t now_ms) const { return sum(seconds_, SECONDS, now_ms / 1000, metric); }
+  uint32_t total_15m(Metric metric, uint32_t now_ms) const {
+    return sum(minutes_, MINUTES, now_ms / 60000, metric);
+  }
+
+  // Highest number of queries seen in a single second.
+  uint32_t peak_1m(uint32_t now_ms) const {
+    uint32_t now = now_ms / 1000;
+    uint32_t peak = 0;
+    for (const auto &bucket : seconds_) {
+      if (live(bucket, now, SECONDS)) {
+        uint32_t count = bucket.counts[static_cast<uint8_t>(Metric::QUERIES)].load(std::memory_order_relaxed);
+        if (count > peak) peak = count;
+      }
+    }
+    return peak;
+  }
+  uint32_t peak_15m(uint32_t now_ms) const {
+    uint32_t now = now_ms / 60000;
+    uint32_t peak = 0;
+    for (const auto &bucket : minutes_) {
+      if (live(bucket, now, MINUTES)) {
+        uint32_t count = bucket.peak.load(std::memory_order_relaxed);
+        if (count > peak) peak = count;
+      }
+    }
+    return peak;
+  }
+
+ protected:
+  struct Bucket {
+    std::atomic<uint32_t> epoch{UINT32_MAX};
+    std::atomic<uint32_t> counts[METRIC_COUNT]{};
+    std::atomic<uint32_t> peak{0};
+  };
+
+  static Bucket &roll(Bucket &bucket, uint32_t epoch) {
+    if (bucket.epoch.load(std::memory_order_relaxed) != epoch) {
+      for (auto &count : bucket.counts) count.store(0, std::memory_order_relaxed);
+      bucket.peak.store(0, std::memory_order_relaxed);
+      bucket.epoch.store(epoch, std::memory_order_release);
+    }
+    return bucket;
+  }
+
+  static bool live(const Bucket &bucket, uint32_t now, uint32_t span) {
+    uint32_t epoch = bucket.epoch.load(std::memory_order_acquire);
+    return epoch != UINT32_MAX && now - epoch < span;
+  }
+
+  static uint32_t sum(const Bucket *buckets, uint8_t count, uint32_t now, Metric metric) {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      if (live(buckets[i], now, count)) {
+        total += buckets[i].counts[static_cast<uint8_t>(metric)].load(std::memory_order_relaxed);
+      }
+    }
+    return total;
+  }
+
+  Bucket seconds_[SECONDS];
+  Bucket minutes_[MINUTES];
+};
+
+// Upper bounds (ms) of the upstream latency histogram buckets; one more
+// bucket catches everything slower.
+static const uint16_t LATENCY_BOUNDS_MS[] = {2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500};
+static const uint8_t LATENCY_BUCKETS = sizeof(LATENCY_BOUNDS_MS) / sizeof(LATENCY_BOUNDS_MS[0]) + 1;
+
+// Cumulative-friendly latency histogram with fixed buckets. Single writer
+// (tcpip thread), lock-free readers.
+class LatencyHistogram {
+ public:
+  void record(uint32_t latency_ms) {
+    uint8_t bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && latency_ms > LATENCY_BOUNDS_MS[bucket]) bucket++;
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_ms_.fetch_add(latency_ms, std::memory_order_relaxed);
+  }
+
+  uint32_t bucket(uint8_t index) const { return buckets_[index].load(std::memory_order_relaxed); }
+  uint32_t sum_ms() const { return sum_ms_.load(std::memory_order_relaxed); }
+  uint32_t count() const {
+    uint32_t total = 0;
+    for (const auto &bucket : buckets_) total += bucket.load(std::memory_order_relaxed);
+    return total;
+  }
+
+ protected:
+  std::atomic<uint32_t> buckets_[LATENCY_BUCKETS]{};
+  std::atomic<uint32_t> sum_ms_{0};
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
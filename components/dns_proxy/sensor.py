@@ -0,0 +1,100 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import sensor
+from esphome.const import (
+    CONF_TYPE,
+    STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
+    UNIT_BYTES,
+    UNIT_MILLISECOND,
+    UNIT_PERCENT,
+)
+
+from . import CONF_DNS_PROXY_ID, DnsRedirect, dns_proxy_ns
+
+DEPENDENCIES = ["dns_proxy"]
+
+TYPE_BENCHMARK_QPS = "benchmark_qps"
+TYPE_BENCHMARK_CYCLES = "benchmark_cycles_per_query"
+TYPE_BENCHMARK_HEAP_DELTA = "benchmark_heap_delta"
+
+CONF_MIN_INTERVAL = "min_interval"
+CONF_DELTA = "delta"
+
+Stat = dns_proxy_ns.enum("Stat", is_class=True)
+
+SETTERS = {
+    TYPE_BENCHMARK_QPS: "set_benchmark_qps_sensor",
+    TYPE_BENCHMARK_CYCLES: "set_benchmark_cycles_sensor",
+    TYPE_BENCHMARK_HEAP_DELTA: "set_benchmark_heap_sensor",
+}
+
+PARENT_SCHEMA = cv.Schema({
+    cv.GenerateID(CONF_DNS_PROXY_ID): cv.use_id(DnsRedirect),
+})
+
+# Sensors published by the component itself whenever their value changes,
+# instead of being polled: type -> (Stat, unit, decimals, state class, icon)
+STATS = {
+    "queries": (Stat.QUERIES, "queries", 0, STATE_CLASS_TOTAL_INCREASING, "mdi:dns"),
+    "forwarded": (Stat.FORWARDED, "queries", 0, STATE_CLASS_TOTAL_INCREASING, "mdi:dns-outline"),
+    "fast_path": (Stat.FAST_PATH, "queries", 0, STATE_CLASS_TOTAL_INCREASING, "mdi:flash"),
+    "timeouts": (Stat.TIMEOUTS, "queries", 0, STATE_CLASS_TOTAL_INCREASING, "mdi:timer-alert-outline"),
+    "dropped": (Stat.DROPPED, "queries", 0, STATE_CLASS_TOTAL_INCREASING, "mdi:close-octagon-outline"),
+    "pending": (Stat.PENDING, "queries", 0, STATE_CLASS_MEASUREMENT, "mdi:tray-full"),
+    "cache_hits": (Stat.CACHE_HITS, "queries", 0, STATE_CLASS_TOTAL_INCREASING, "mdi:database-check"),
+    "cache_misses": (Stat.CACHE_MISSES, "queries", 0, STATE_CLASS_TOTAL_INCREASING, "mdi:database-remove"),
+    "cache_entries": (Stat.CACHE_ENTRIES, "entries", 0, STATE_CLASS_MEASUREMENT, "mdi:database"),
+    "qps_1m": (Stat.QPS_1M, "queries/s", 2, STATE_CLASS_MEASUREMENT, "mdi:speedometer"),
+    "qps_15m": (Stat.QPS_15M, "queries/s", 2, STATE_CLASS_MEASUREMENT, "mdi:speedometer"),
+    "hit_ratio_1m": (Stat.HIT_RATIO_1M, UNIT_PERCENT, 1, STATE_CLASS_MEASUREMENT, "mdi:bullseye-arrow"),
+    "forward_ratio_1m": (Stat.FORWARD_RATIO_1M, UNIT_PERCENT, 1, STATE_CLASS_MEASUREMENT, "mdi:call-split"),
+    "upstream_latency_p50": (Stat.LATENCY_P50, UNIT_MILLISECOND, 0, STATE_CLASS_MEASUREMENT, "mdi:timer-outline"),
+    "upstream_latency_p90": (Stat.LATENCY_P90, UNIT_MILLISECOND, 0, STATE_CLASS_MEASUREMENT, "mdi:timer-outline"),
+    "upstream_latency_p99": (Stat.LATENCY_P99, UNIT_MILLISECOND, 0, STATE_CLASS_MEASUREMENT, "mdi:timer-outline"),
+}
+
+STAT_SCHEMA = PARENT_SCHEMA.extend({
+    cv.Optional(CONF_MIN_INTERVAL, default="1s"): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_DELTA, default=0): cv.positive_float,
+})
+
+CONFIG_SCHEMA = cv.typed_schema({
+    TYPE_BENCHMARK_QPS: sensor.sensor_schema(
+        unit_of_measurement="queries/s",
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_MEASUREMENT,
+        icon="mdi:speedometer",
+    ).extend(PARENT_SCHEMA),
+    TYPE_BENCHMARK_CYCLES: sensor.sensor_schema(
+        unit_of_measurement="cycles",
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_MEASUREMENT,
+        icon="mdi:chip",
+    ).extend(PARENT_SCHEMA),
+    TYPE_BENCHMARK_HEAP_DELTA: sensor.sensor_schema(
+        unit_of_measurement=UNIT_BYTES,
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_MEASUREMENT,
+        icon="mdi:memory",
+    ).extend(PARENT_SCHEMA),
+    **{
+        name: sensor.sensor_schema(
+            unit_of_measurement=unit,
+            accuracy_decimals=decimals,
+            state_class=state_class,
+            icon=icon,
+        ).extend(STAT_SCHEMA)
+        for name, (_, unit, decimals, state_class, icon) in STATS.items()
+    },
+}, key=CONF_TYPE)
+
+
+async def to_code(config):
+    parent = await cg.get_variable(config[CONF_DNS_PROXY_ID])
+    sens = await sensor.new_sensor(config)
+    if config[CONF_TYPE] in STATS:
+        stat = STATS[config[CONF_TYPE]][0]
+        cg.add(parent.add_stat_sensor(sens, stat, config[CONF_MIN_INTERVAL], config[CONF_DELTA]))
+    else:
+        cg.add(getattr(parent, SETTERS[config[CONF_TYPE]])(sens))
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "esphome/components/sensor/sensor.h"
+#include "rate_window.h"
+#include <cmath>
+#include <cstdint>
+
+namespace esphome {
+namespace dns_proxy {
+
+// Values the sensor platform can publish.
+enum class Stat : uint8_t {
+  QUERIES,
+  FORWARDED,
+  FAST_PATH,
+  TIMEOUTS,
+  DROPPED,
+  PENDING,
+  CACHE_HITS,
+  CACHE_MISSES,
+  CACHE_ENTRIES,
+  QPS_1M,
+  QPS_15M,
+  HIT_RATIO_1M,
+  FORWARD_RATIO_1M,
+  LATENCY_P50,
+  LATENCY_P90,
+  LATENCY_P99,
+};
+
+// How often the main loop looks at the values; publishing is further limited
+// per sensor by min_interval and delta.
+static const uint32_t STAT_CHECK_INTERVAL_MS = 250;
+
+// A sensor fed straight from the component's counters. It publishes only when
+// its value moved by at least `delta` (any change for 0), and never more often
+// than every `min_interval_ms`.
+struct StatSensor {
+  sensor::Sensor *sensor;
+  Stat stat;
+  uint32_t min_interval_ms;
+  float delta;
+  float last_value{NAN};
+  uint32_t last_publish_ms{0};
+
+  void update(float value, uint32_t now) {
+    if (std::isnan(value)) return;
+    if (!std::isnan(last_value)) {
+      if (now - last_publish_ms < min_interval_ms) return;
+      if (value == last_value || std::fabs(value - last_value) < delta) return;
+    }
+    last_value = value;
+    last_publish_ms = now;
+    sensor->publish_state(value);
+  }
+};
+
+// Percentiles of a LatencyHistogram over recent answers only: the counts are
+// taken relative to a baseline snapshot that is moved forward every period,
+// so the result covers the last one to two periods.
+class LatencyWindow {
+ public:
+  static const uint32_t PERIOD_MS = 60000;
+
+  void update(const LatencyHistogram &histogram, uint32_t now) {
+    if (now - rolled_ms_ < PERIOD_MS) return;
+    rolled_ms_ = now;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+      baseline_[i] = middle_[i];
+      middle_[i] = histogram.bucket(i);
+    }
+  }
+
+  // Linear interpolation inside the bucket holding the p-th fraction; NAN
+  // if there were no answers in the window.
+  float percentile(const LatencyHistogram &histogram, float p) const {
+    uint32_t counts[LATENCY_BUCKETS];
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+      counts[i] = histogram.bucket(i) - baseline_[i];
+      total += counts[i];
+    }
+    if (total == 0) return NAN;
+
+    float rank = p * total;
+    uint32_t below = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+      if (below + counts[i] >= rank && counts[i] > 0) {
+        float lower = i == 0 ? 0.0f : LATENCY_BOUNDS_MS[i - 1];
+        if (i == LATENCY_BUCKETS - 1) return lower;  // Open-ended bucket
+        return lower + (LATENCY_BOUNDS_MS[i] - lower) * (rank - below) / counts[i];
+      }
+      below += counts[i];
+    }
+    return LATENCY_BOUNDS_MS[LATENCY_BUCKETS - 2];
+  }
+
+ protected:
+  uint32_t baseline_[LATENCY_BUCKETS]{};
+  uint32_t middle_[LATENCY_BUCKETS]{};
+  uint32_t rolled_ms_{0};
+};
+
+}  // namespace dns_proxy
+}  // namespace esphome
@@ -0,0 +1,28 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import text_sensor
+from esphome.const import CONF_TYPE
+
+from . import CONF_DNS_PROXY_ID, DnsRedirect
+
+DEPENDENCIES = ["dns_proxy"]
+
+TYPE_LAST_QUERY = "last_query"
+
+SETTERS = {
+    TYPE_LAST_QUERY: "set_last_query_text_sensor",
+}
+
+PARENT_SCHEMA = cv.Schema({
+    cv.GenerateID(CONF_DNS_PROXY_ID): cv.use_id(DnsRedirect),
+})
+
+CONFIG_SCHEMA = cv.typed_schema({
+    TYPE_LAST_QUERY: text_sensor.text_sensor_schema(icon="mdi:dns").extend(PARENT_SCHEMA),
+}, key=CONF_TYPE)
+
+
+async def to_code(config):
+    parent = await cg.get_variable(config[CONF_DNS_PROXY_ID])
+    sens = await text_sensor.new_text_sensor(config)
+    cg.add(getattr(parent, SETTERS[config[CONF_TYPE]])(sens))